@@ -4,25 +4,97 @@
 #include <linux/delay.h>
 #include <linux/smp.h>
 #include <linux/jhash.h>
+#include <linux/moduleparam.h>
+#include <linux/kprobes.h>
+#include <linux/percpu.h>
+#include <linux/pid.h>
+#include <linux/rcupdate.h>
+#include <linux/sched/signal.h>
+#include <linux/nodemask.h>
+#include <linux/topology.h>
+#include <linux/mutex.h>
+#include <linux/sort.h>
 
+/*
+ * Processor topology, as of the last detect_topology(). Online CPUs are
+ * listed node by node in cpu_order, and within a node LLC group by LLC
+ * group with SMT siblings next to each other.
+ */
+static int num_nodes;
+static int node_ids[MAX_NUMNODES];
+static int node_first[MAX_NUMNODES], node_ncpus[MAX_NUMNODES];
+static int *cpu_order;
+// threads a clique may hold, the cpus of the smallest node
+static int clique_cap;
+static struct cpumask topo_left, topo_llc, chosen_cpus;
 
-// static int num_nodes = 0, num_cpus = 0, 
-//     num_cores = 0, num_threads = 0,
-//     cores_per_node;
+struct rhashtable thread_table;
+struct process_info process_list;
+DEFINE_HASHTABLE(process_comms, PROCESS_HASH_BITS);
+DEFINE_HASHTABLE(process_tgids, PROCESS_HASH_BITS);
 
-static int num_nodes = 2, cores_per_node = 8;
+unsigned int mem_sets_shift = 12;
+module_param(mem_sets_shift, uint, 0444);
+MODULE_PARM_DESC(mem_sets_shift, "log2 of the sets in each process's page-sharing table");
 
-struct c_thread_info thread_list[1UL << PID_HASH_BITS];
-struct process_info process_list;
+unsigned int mem_sample_shift = 2;
+module_param(mem_sample_shift, uint, 0444);
+MODULE_PARM_DESC(mem_sample_shift, "track 1 in 2^mem_sample_shift pages");
+
+unsigned int max_threads = 1024;
+module_param(max_threads, uint, 0444);
+MODULE_PARM_DESC(max_threads, "threads tracked per process, at most 4096");
+
+static unsigned int fault_sample_period = 4;
+module_param(fault_sample_period, uint, 0644);
+MODULE_PARM_DESC(fault_sample_period, "record 1 in this many page faults of a tracked thread");
+
+static unsigned int scan_interval_ms = 1000;
+module_param(scan_interval_ms, uint, 0644);
+MODULE_PARM_DESC(scan_interval_ms, "interval between scans for new and exited threads");
+
+static unsigned int place_interval_ms = 2000;
+module_param(place_interval_ms, uint, 0644);
+MODULE_PARM_DESC(place_interval_ms, "interval between placement rounds");
+
+static unsigned int migrate_threshold = 10;
+module_param(migrate_threshold, uint, 0644);
+MODULE_PARM_DESC(migrate_threshold, "percentage of cross-node communication a new placement must save");
 
+/*
+ * A placement that needs more moves than the budget left is applied a part
+ * at a time, the closest cliques first, and carried on in later rounds until
+ * it is done or no longer cuts any cross-node communication.
+ */
+static unsigned int max_migrations = 16;
+module_param(max_migrations, uint, 0644);
+MODULE_PARM_DESC(max_migrations, "threads moved to another cpu per placement round");
 
+// the scanner and the placement daemon both walk process_list
+static DEFINE_MUTEX(process_lock);
+
+
+// threads placed on each cpu so far this placement round, indexed by cpu
 int *cpu_state = NULL;
-int threads_chosen[NTHREADS];
+/*
+ * Placement chosen for each tid: a cpu, CHOSEN_NONE, or CHOSEN_NODE(n) to
+ * float over the whole of the n-th node in cpu_order.
+ */
+#define CHOSEN_NONE (-1)
+#define CHOSEN_NODE(n) (-2 - (n))
+static int *threads_chosen;
 int cliques_size;
-static struct clique cliques[NTHREADS];
+// all indexed by tid, max_threads entries
+static struct clique *cliques;
+static int *next_member, *clique_of;
+static long *distance;
+static int *touched;
+
+#define for_each_member(c, t) \
+    for ((t) = (c)->first; (t) != -1; (t) = next_member[t])
 
-// communication rates between threads
-int default_matrix[NTHREADS * NTHREADS] = {
+// communication rates between threads, one block
+int default_matrix[CM_SIDE * CM_SIDE] = {
     0,  12, 5,  3,  0,  1,  1,  1,  0, 0,  0,  0,  0,  0,  0, 0,  0,  0,  1, 0, 0, 0, 1,  0,  0,  0,  0,  1,  0,  1,  4,  11,
     12, 0,  12, 2,  0,  0,  0,  0,  0, 0,  0,  0,  0,  0,  0, 0,  0,  0,  0, 0, 0, 0, 0,  0,  0,  0,  0,  0,  1,  0,  1,  0,
     5,  12, 0,  12, 1,  4,  0,  0,  0, 0,  0,  0,  0,  0,  0, 0,  0,  0,  0, 0, 0, 0, 0,  0,  0,  0,  0,  0,  0,  0,  1,  1,
@@ -58,67 +130,153 @@ int default_matrix[NTHREADS * NTHREADS] = {
 };
 
 // Processor topology
-// static void detect_topology(void) {
-//   int node, cpu, core, thread;
-//   if (num_nodes)
-//     return;
-
-//   for_each_online_node(node) {
-//     ++num_nodes;
-//     for_each_node_cpu(cpu, node) {
-//       ++num_cpus;
-//       for_each_core(core, cpu) {
-//         ++num_cores;
-//         for_each_sibling(thread, core) {
-//           ++num_threads;
-//         }
-//       }
-//     }
-//   }
-// #ifdef C_PRINT
-//   printk(KERN_INFO
-//            "topology: %d nodes, %d cpus, %d cores, %d threads",
-//            num_nodes, num_cpus, num_cores, num_threads);
-// #endif
-//   cores_per_node = num_threads / num_nodes;*/
-// }
-
-void init_scheduler(void) {
-    // detect_topology();
+static inline
+const struct cpumask *cpu_llc_mask(int cpu) {
+#ifdef CONFIG_X86
+    return cpu_llc_shared_mask(cpu);
+#else
+    return cpumask_of_node(cpu_to_node(cpu));
+#endif
+}
+
+// called with cpus read-locked
+static void detect_topology(void) {
+    int nid, cpu, core, thread, n = 0;
+
+    num_nodes = 0;
+    clique_cap = INT_MAX;
+    for_each_online_node(nid) {
+        cpumask_and(&topo_left, cpumask_of_node(nid), cpu_online_mask);
+        if (cpumask_empty(&topo_left))
+            continue;
+        node_ids[num_nodes] = nid;
+        node_first[num_nodes] = n;
+
+        while ((cpu = cpumask_first(&topo_left)) < nr_cpu_ids) {
+            // the LLC group of cpu, core by core
+            cpumask_and(&topo_llc, cpu_llc_mask(cpu), &topo_left);
+            cpumask_set_cpu(cpu, &topo_llc);
+            while ((core = cpumask_first(&topo_llc)) < nr_cpu_ids) {
+                cpu_order[n++] = core;
+                cpumask_clear_cpu(core, &topo_llc);
+                cpumask_clear_cpu(core, &topo_left);
+                for_each_cpu_and(thread, topology_sibling_cpumask(core), &topo_llc) {
+                    cpu_order[n++] = thread;
+                    cpumask_clear_cpu(thread, &topo_left);
+                }
+                cpumask_andnot(&topo_llc, &topo_llc, topology_sibling_cpumask(core));
+            }
+        }
+        node_ncpus[num_nodes] = n - node_first[num_nodes];
+        clique_cap = min(clique_cap, node_ncpus[num_nodes]);
+        ++num_nodes;
+    }
+#ifdef C_PRINT
+    printk(KERN_INFO "topology: %d nodes, %d cpus", num_nodes, n);
+#endif
+}
+
+static int *cur_node, *new_node;
+
+static void free_scheduler(void) {
+    kfree(cpu_order);
+    kfree(cpu_state);
+    kfree(threads_chosen);
+    kfree(cliques);
+    kfree(next_member);
+    kfree(clique_of);
+    kfree(distance);
+    kfree(touched);
+    kfree(cur_node);
+    kfree(new_node);
+}
+
+int init_scheduler(void) {
+    int ret;
+    max_threads = round_up(clamp(max_threads, (unsigned int) CM_SIDE, MAX_THREADS_LIMIT), CM_SIDE);
+    cpu_order = kmalloc_array(nr_cpu_ids, sizeof(int), GFP_KERNEL);
+    cpu_state = kcalloc(nr_cpu_ids, sizeof(int), GFP_KERNEL);
+    threads_chosen = kcalloc(max_threads, sizeof(int), GFP_KERNEL);
+    cliques = kcalloc(max_threads, sizeof(struct clique), GFP_KERNEL);
+    next_member = kcalloc(max_threads, sizeof(int), GFP_KERNEL);
+    clique_of = kcalloc(max_threads, sizeof(int), GFP_KERNEL);
+    distance = kcalloc(max_threads, sizeof(long), GFP_KERNEL);
+    touched = kcalloc(max_threads, sizeof(int), GFP_KERNEL);
+    cur_node = kcalloc(max_threads, sizeof(int), GFP_KERNEL);
+    new_node = kcalloc(max_threads, sizeof(int), GFP_KERNEL);
+    if (!cpu_order || !cpu_state || !threads_chosen || !cliques || !next_member || !clique_of ||
+        !distance || !touched || !cur_node || !new_node) {
+        free_scheduler();
+        return -ENOMEM;
+    }
+    ret = rhashtable_init(&thread_table, &thread_params);
+    if (ret < 0) {
+        free_scheduler();
+        return ret;
+    }
+    mem_sets_shift = clamp(mem_sets_shift, MEM_SETS_SHIFT_MIN, MEM_SETS_SHIFT_MAX);
+    mem_sample_shift = min(mem_sample_shift, 32U - mem_sets_shift);
     INIT_LIST_HEAD(&process_list.list);
     process_list.comm[0] = '\0';
-    memset(thread_list, 0, sizeof(thread_list));
+    return 0;
+}
+
+static void free_thread(void *ptr, void *arg) {
+    kfree(ptr);
 }
 
 void exit_scheduler(void) {
     // we do cleanup here
     struct process_info *pi;
 	struct list_head *curr, *q;
+    rhashtable_free_and_destroy(&thread_table, free_thread, NULL);
     list_for_each_safe(curr, q, &process_list.list) {
         pi = list_entry(curr, struct process_info, list);
         printk(KERN_ERR "Process %s exit", pi->comm);
-        // vfree(pi->mcs);
         list_del(&pi->list);
-        kfree(pi);
+        free_process_info(pi);
     }
+    free_scheduler();
 }
 
 static inline
-void set_affinity(int pid, int core) {
+void set_affinity(int pid, const struct cpumask *cpus) {
     struct cpumask mask;
-    cpumask_clear(&mask);
-    cpumask_set_cpu(core, &mask);
-    sched_setaffinity(pid, &mask);
+    // cpus may have gone offline since the analysis
+    if (cpumask_and(&mask, cpus, cpu_online_mask))
+        sched_setaffinity(pid, &mask);
+}
+
+// the cpus of threads_chosen[tid] into chosen_cpus, empty if none
+static void chosen_mask(int tid) {
+    int chosen = threads_chosen[tid], n, i;
+    cpumask_clear(&chosen_cpus);
+    if (chosen >= 0) {
+        cpumask_set_cpu(chosen, &chosen_cpus);
+        return;
+    }
+    if (chosen == CHOSEN_NONE)
+        return;
+    n = CHOSEN_NODE(chosen);
+    for (i = 0; i < node_ncpus[n]; ++i)
+        cpumask_set_cpu(cpu_order[node_first[n] + i], &chosen_cpus);
+}
+
+static int chosen_node(int tid) {
+    int chosen = threads_chosen[tid];
+    if (chosen == CHOSEN_NONE)
+        return NUMA_NO_NODE;
+    return chosen >= 0 ? cpu_to_node(chosen) : node_ids[CHOSEN_NODE(chosen)];
 }
 
 #ifdef C_PRINT
 
-static void print_matrix(int *k, int size) {
+static void print_matrix(struct cmatrix *k, int size) {
     int i, j;
     printk(KERN_ERR "------[ matrix ]------\n");
     for (i = 0; i < size; ++i) {
         for (j = 0; j < size; ++j) {
-            printk(KERN_CONT "%2d ", k[SUBSCRIPT(i, j)]);
+            printk(KERN_CONT "%2d ", cm_get(k, i, j));
         }
         printk(KERN_CONT "\n");
     }
@@ -136,7 +294,7 @@ static void print_array(int *k, int size) {
 static void print_clique_sizes(void) {
     int i;
     printk(KERN_ERR "");
-    for (i = 0; i < NTHREADS; ++i) {
+    for (i = 0; i < max_threads; ++i) {
         if (cliques[i].flag == C_VALID) {
             printk(KERN_CONT "%d ", cliques[i].size);
         }
@@ -145,12 +303,12 @@ static void print_clique_sizes(void) {
 }
 
 int print_clique(struct clique *c) {
-    int j;
+    int t;
 #ifdef VALID_ONLY
     if (c->flag == C_VALID) {
         printk(KERN_ERR "{");
-        for (j = 0; j < c->size; ++j) {
-            printk(KERN_CONT "%d ", c->pids[j]);
+        for_each_member(c, t) {
+            printk(KERN_CONT "%d ", t);
         }
         printk(KERN_CONT "}");
         return 0;
@@ -169,8 +327,8 @@ int print_clique(struct clique *c) {
             break;
     }
     printk("{");
-    for (j = 0; j < c->size; ++j) {
-        printk("%d ", c->pids[j]);
+    for_each_member(c, t) {
+        printk("%d ", t);
     }
     printk("}");
     return 0;
@@ -179,7 +337,7 @@ int print_clique(struct clique *c) {
 void print_cliques(void) {
     int i, r;
     printk(KERN_ERR "-------------------------------------------------------\n");
-    for (i = 0; i < NTHREADS; ++i) {
+    for (i = 0; i < max_threads; ++i) {
         r = print_clique(cliques + i);
         if (r == 0) {
             printk(KERN_CONT"\n");
@@ -211,32 +369,8 @@ void print_processes(void) {
 
 #endif // C_PRINT
 
-int clique_distance(struct clique *c1, struct clique *c2, int *matrix) {
-    int ret = 0, i, j;
-    if (c1 && c2) {
-#ifndef C_USEMAX
-        for (i = 0; i < c1->size; ++i) {
-            for (j = 0; j < c2->size; ++j) {
-                ret += matrix[SUBSCRIPT(c1->pids[i], c2->pids[j])];
-            }
-        }
-#else
-        for (i = 0; i < c1->size; ++i) {
-            for (j = 0; j < c2->size; ++j) {
-                if (ret < matrix[SUBSCRIPT(c1->pids[i], c2->pids[j])]) {
-                    ret = matrix[SUBSCRIPT(c1->pids[i], c2->pids[j])];
-                }
-            }
-        }
-#endif
-    } else {
-        printk("clique_distance: NULL pointer\n");
-        ret = -1;
-    }
-    return ret;
-}
-
 void merge_clique(struct clique *c1, struct clique *c2) {
+    int t;
     if (c1 && c2) {
 #ifdef C_PRINT
         printk("Merging: ");
@@ -254,7 +388,11 @@ void merge_clique(struct clique *c1, struct clique *c2) {
                 c1->flag = C_REUSE;
                 cliques_size--;
             } else {
-                memcpy(c1->pids + c1->size, c2->pids, sizeof(int) * c2->size);
+                for_each_member(c2, t) {
+                    clique_of[t] = c1 - cliques;
+                }
+                next_member[c1->last] = c2->first;
+                c1->last = c2->last;
                 c1->size = c1->size + c2->size;
                 c1->flag = C_REUSE;
                 c2->flag = C_INVALID;
@@ -270,7 +408,7 @@ struct clique *get_first_valid(void) {
     struct clique *ret = cliques;
     while (ret->flag != C_VALID) {
         ret++;
-        if (ret == cliques + NTHREADS) {
+        if (ret == cliques + max_threads) {
             printk("get_first_valid: NO valid clique\n");
             return NULL;
         }
@@ -278,25 +416,60 @@ struct clique *get_first_valid(void) {
     return ret;
 }
 
-struct clique *find_neighbor(struct clique *c1) {
-    struct clique *c2, *temp = cliques;
-    int distance = -1, temp_int;
-    while (temp < cliques + NTHREADS) {
-        if (temp != c1 && temp->flag == C_VALID) {
-            temp_int = clique_distance(c1, temp, default_matrix);
-            if (temp_int > distance) {
-                distance = temp_int;
-                c2 = temp;
+/*
+ * Add up the communication of c1 with each other valid clique over the
+ * nonzero blocks of c1's rows, so that a round of merging costs what was
+ * recorded rather than the square of the threads. Only cliques that fit
+ * with c1 in clique_cap threads are candidates.
+ * @return the clique closest to c1, any other valid one if c1 talks to none,
+ * NULL if none fits.
+ */
+struct clique *find_neighbor(struct clique *c1, struct cmatrix *matrix) {
+    struct clique *c2 = NULL, *temp;
+    int t, b, k, c, v, ntouched = 0, *blk;
+    long best = 0;
+    for_each_member(c1, t) {
+        for (b = 0; b < matrix->nblocks; ++b) {
+            blk = matrix->blocks[(t >> CM_SHIFT) * matrix->nblocks + b];
+            if (!blk)
+                continue;
+            for (k = 0; k < CM_SIDE; ++k) {
+                v = blk[SUBSCRIPT(t & (CM_SIDE - 1), k)];
+                c = clique_of[(b << CM_SHIFT) + k];
+                if (v <= 0 || cliques[c].flag != C_VALID || cliques + c == c1 ||
+                    c1->size + cliques[c].size > clique_cap)
+                    continue;
+                if (!distance[c])
+                    touched[ntouched++] = c;
+#ifndef C_USEMAX
+                distance[c] += v;
+#else
+                distance[c] = max(distance[c], (long) v);
+#endif
             }
         }
-        temp++;
     }
-    return c2;
+    for (k = 0; k < ntouched; ++k) {
+        c = touched[k];
+        if (distance[c] > best) {
+            best = distance[c];
+            c2 = cliques + c;
+        }
+        distance[c] = 0;
+    }
+    if (c2)
+        return c2;
+    for (temp = cliques; temp < cliques + max_threads; ++temp) {
+        if (temp != c1 && temp->flag == C_VALID &&
+            c1->size + temp->size <= clique_cap)
+            return temp;
+    }
+    return NULL;
 }
 
 void reset_cliques(void) {
     struct clique *temp = cliques;
-    while (temp < cliques + NTHREADS) {
+    while (temp < cliques + max_threads) {
         if (temp->flag == C_REUSE) {
             temp->flag = C_VALID;
             ++cliques_size;
@@ -305,57 +478,117 @@ void reset_cliques(void) {
     }
 }
 
-void init_cliques(void) {
+// one clique per live thread of pi, the others are left invalid
+void init_cliques(struct process_info *pi) {
     int i;
-    for (i = 0; i < NTHREADS; ++i) {
-        cliques[i].pids[0] = i;
+    cliques_size = 0;
+    for (i = 0; i < max_threads; ++i) {
+        threads_chosen[i] = CHOSEN_NONE;
+        next_member[i] = -1;
+        clique_of[i] = i;
+        distance[i] = 0;
+        if (pi->pids[i] == -1) {
+            cliques[i].first = cliques[i].last = -1;
+            cliques[i].size = 0;
+            cliques[i].flag = C_INVALID;
+            continue;
+        }
+        cliques[i].first = cliques[i].last = i;
         cliques[i].size = 1;
         cliques[i].flag = C_VALID;
+        ++cliques_size;
     }
-    cliques_size = NTHREADS;
 }
 
-void init_matrix(int *matrix) {
-    memcpy(matrix, default_matrix, sizeof(default_matrix));
+// canned matrix, for testing the analysis without live input
+void init_matrix(struct cmatrix *matrix) {
+    int *blk = cm_entry(matrix, 0, 0, GFP_KERNEL);
+    if (blk)
+        memcpy(blk, default_matrix, sizeof(default_matrix));
 }
 
+static int free_cpus(int node) {
+    int i, n = 0;
+    for (i = 0; i < node_ncpus[node]; ++i)
+        n += !cpu_state[cpu_order[node_first[node] + i]];
+    return n;
+}
+
+/*
+ * Clique members are in merge order, so the closest pairs sit next to each
+ * other and take SMT siblings, then the rest of an LLC group, skipping the
+ * cpus other cliques already hold. A clique that does not fit in the free
+ * cpus left on its node floats over the whole node rather than stacking up
+ * on cores, and holds none of them.
+ */
 void assign_cpus_for_clique(struct clique *c, int node) {
-    int cpu_curr = cores_per_node * node, size = c->size, *pids = c->pids, i;
-    for (i = 0; i < size; ++i) {
-        threads_chosen[pids[i]] = cpu_curr++;
-        if (cpu_curr == (node + 1) * cores_per_node) {
-            cpu_curr = cores_per_node * node;
+    int i = 0, t;
+    int *cpus = cpu_order + node_first[node];
+    bool fits = c->size <= free_cpus(node);
+    for_each_member(c, t) {
+        if (!fits) {
+            threads_chosen[t] = CHOSEN_NODE(node);
+            continue;
         }
+        while (cpu_state[cpus[i]])
+            ++i;
+        threads_chosen[t] = cpus[i];
+        ++cpu_state[cpus[i]];
     }
 }
 
+// each clique to the node with the most free cpus, counted across processes
 void calculate_threads_chosen(void) {
-    int i, node = 0;
-    for (i = 0; i < NTHREADS; ++i) {
-        if (cliques[i].flag == C_VALID) {
-            assign_cpus_for_clique(cliques + i, node++);
+    int i, n, node, best;
+    if (!num_nodes)
+        return;
+    for (i = 0; i < max_threads; ++i) {
+        if (cliques[i].flag != C_VALID)
+            continue;
+        for (node = 0, best = -1, n = 0; n < num_nodes; ++n) {
+            if (free_cpus(n) > best) {
+                best = free_cpus(n);
+                node = n;
+            }
         }
+        assign_cpus_for_clique(cliques + i, node);
     }
 #ifdef C_PRINT
     printk("Threads chosen:\n");
-    for (i = 0; i < NTHREADS; ++i) {
-        printk("%d -> %d\n", i, threads_chosen[i]);
+    for (i = 0; i < max_threads; ++i) {
+        chosen_mask(i);
+        if (!cpumask_empty(&chosen_cpus))
+            printk("%d -> %*pbl\n", i, cpumask_pr_args(&chosen_cpus));
     }
 #endif
 }
 
-void clique_analysis(void) {
+// group the threads of pi by its recorded matrix into threads_chosen
+void clique_analysis(struct process_info *pi) {
     struct clique *c1, *c2;
-    init_cliques();
+    bool merged;
+    get_online_cpus();
+    detect_topology();
+    fold_matrix(pi);
+    init_cliques(pi);
 #ifdef C_PRINT
-    print_matrix(default_matrix, NTHREADS);
+    print_matrix(pi->matrix, min_t(int, max_threads, CM_SIDE));
     print_cliques();
 #endif
-    while (cliques_size > num_nodes) {
+    // merge pairwise, round after round, until no two cliques fit together
+    do {
+        merged = false;
         while (cliques_size > 0) {
             c1 = get_first_valid();
-            c2 = find_neighbor(c1);
+            c2 = find_neighbor(c1, pi->matrix);
+            if (!c2) {
+                // odd one out, carried over to the next round as is
+                c1->flag = C_REUSE;
+                cliques_size--;
+                continue;
+            }
             merge_clique(c1, c2);
+            merged = true;
         }
         reset_cliques();
 #ifdef C_PRINT
@@ -364,35 +597,480 @@ void clique_analysis(void) {
         printk(KERN_ERR "cliques_size: %d, with ", cliques_size);
         print_clique_sizes();
 #endif
-    }
+    } while (merged);
     calculate_threads_chosen();
+    put_online_cpus();
+}
+
+// cpu of thread pid of pi, -1 if it has exited or its pid went to another process
+static int thread_cpu(struct process_info *pi, int pid) {
+    struct task_struct *t;
+    int cpu = -1;
+
+    rcu_read_lock();
+    t = pid_task(find_pid_ns(pid, &init_pid_ns), PIDTYPE_PID);
+    if (t && t->tgid == pi->tgid)
+        cpu = task_cpu(t);
+    rcu_read_unlock();
+    return cpu;
+}
+
+// communication of pi between threads on different nodes, if tid x is on node[x]
+static long cross_node_cost(struct process_info *pi, int *node) {
+    struct cmatrix *m = pi->matrix;
+    long cost = 0;
+    int bi, bj, i, j, x, y, *blk;
+    // the matrix is symmetric, so the upper triangle of blocks will do
+    for (bi = 0; bi < m->nblocks; ++bi) {
+        for (bj = bi; bj < m->nblocks; ++bj) {
+            blk = m->blocks[bi * m->nblocks + bj];
+            if (!blk)
+                continue;
+            for (i = 0; i < CM_SIDE; ++i) {
+                x = (bi << CM_SHIFT) + i;
+                if (node[x] == NUMA_NO_NODE)
+                    continue;
+                for (j = 0; j < CM_SIDE; ++j) {
+                    y = (bj << CM_SHIFT) + j;
+                    if (y > x && node[y] != NUMA_NO_NODE && node[x] != node[y])
+                        cost += blk[SUBSCRIPT(i, j)];
+                }
+            }
+        }
+    }
+    return cost;
 }
 
+// cliques by the communication within them, as left in distance[]
+static int cmp_closeness(const void *a, const void *b) {
+    long da = distance[*(const int *) a], db = distance[*(const int *) b];
+    return da < db ? 1 : da > db ? -1 : 0;
+}
 
+/*
+ * Move the threads of pi to the cpus clique_analysis() chose for them, the
+ * closest cliques first, moving at most budget of them off their current
+ * cpu. The threads left behind keep their cpus, and node[] is set to where
+ * every thread is now.
+ * @return the number of threads moved, *left whether any were left behind.
+ */
+int apply_placement(struct process_info *pi, int budget, int *node, bool *left) {
+    int i, k, n = 0, t, u, pid, cpu, moved = 0;
+
+    for (i = 0; i < max_threads; ++i) {
+        if (cliques[i].flag != C_VALID)
+            continue;
+        for_each_member(cliques + i, t) {
+            for_each_member(cliques + i, u)
+                distance[i] += cm_get(pi->matrix, t, u);
+        }
+        touched[n++] = i;
+    }
+    sort(touched, n, sizeof(int), cmp_closeness, NULL);
+
+    *left = false;
+    for (k = 0; k < n; ++k) {
+        distance[touched[k]] = 0;
+        for_each_member(cliques + touched[k], t) {
+            pid = pi->pids[t];
+            cpu = thread_cpu(pi, pid);
+            node[t] = NUMA_NO_NODE;
+            if (cpu < 0)
+                continue;
+            chosen_mask(t);
+            if (!cpumask_test_cpu(cpu, &chosen_cpus)) {
+                if (moved == budget) {
+                    // stays put, on the cpu it holds instead of the chosen one
+                    if (threads_chosen[t] >= 0)
+                        --cpu_state[threads_chosen[t]];
+                    ++cpu_state[cpu];
+                    node[t] = cpu_to_node(cpu);
+                    *left = true;
+                    continue;
+                }
+                ++moved;
+            }
+            set_affinity(pid, &chosen_cpus);
+            node[t] = chosen_node(t);
+        }
+    }
+    return moved;
+}
+
+// give back the cpus calculate_threads_chosen() held for the last analysis
+static void release_chosen(void) {
+    int i;
+    for (i = 0; i < max_threads; ++i) {
+        if (threads_chosen[i] >= 0)
+            --cpu_state[threads_chosen[i]];
+        threads_chosen[i] = CHOSEN_NONE;
+    }
+}
+
+// hold the cpus the threads of pi run on for the processes placed after it
+static void hold_current(struct process_info *pi) {
+    int i, cpu;
+    for (i = 0; i < max_threads; ++i) {
+        if (pi->pids[i] == -1)
+            continue;
+        cpu = thread_cpu(pi, pi->pids[i]);
+        if (cpu >= 0)
+            ++cpu_state[cpu];
+    }
+}
+
+/*
+ * Recompute the placement of every process, and apply it only when it cuts
+ * cross-node communication by more than migrate_threshold percent, so that
+ * noise in the matrix does not bounce threads around. A placement cut short
+ * by the max_migrations budget goes on in the next rounds as long as it cuts
+ * anything. Processes are placed in turn around the cpus the ones before
+ * them hold in cpu_state.
+ */
+void place_processes(void) {
+    struct process_info *pi;
+    struct list_head *curr;
+    int i, cpu, budget = READ_ONCE(max_migrations);
+    long cost_cur, cost_new, cost_applied;
+    bool left;
+
+    memset(cpu_state, 0, nr_cpu_ids * sizeof(int));
+    list_for_each(curr, &process_list.list) {
+        pi = list_entry(curr, struct process_info, list);
+        if (budget <= 0)
+            break;
+        if (atomic_read(&pi->nthreads) <= 1) {
+            hold_current(pi);
+            continue;
+        }
+
+        clique_analysis(pi);
+        for (i = 0; i < max_threads; ++i) {
+            cur_node[i] = new_node[i] = NUMA_NO_NODE;
+            if (pi->pids[i] == -1 || threads_chosen[i] == CHOSEN_NONE)
+                continue;
+            cpu = thread_cpu(pi, pi->pids[i]);
+            if (cpu >= 0)
+                cur_node[i] = cpu_to_node(cpu);
+            new_node[i] = chosen_node(i);
+        }
+        cost_cur = cross_node_cost(pi, cur_node);
+        cost_new = cross_node_cost(pi, new_node);
+#ifdef C_PRINT
+        printk(KERN_INFO "%s: cross-node cost %ld, %ld if placed", pi->comm,
+               cost_cur, cost_new);
+#endif
+        if (cost_new * 100 < cost_cur * (100 - (long)READ_ONCE(migrate_threshold)) ||
+            (pi->placing && cost_new < cost_cur)) {
+            budget -= apply_placement(pi, budget, new_node, &left);
+            // the rest is carried over only if it still has something to cut
+            cost_applied = cross_node_cost(pi, new_node);
+            pi->placing = left && cost_new < cost_applied;
+#ifdef C_PRINT
+            printk(KERN_INFO "%s: cross-node cost %ld applied%s", pi->comm,
+                   cost_applied, left ? ", more next round" : "");
+#endif
+        } else {
+            pi->placing = false;
+            release_chosen();
+            hold_current(pi);
+        }
+    }
+}
+
+
+
+/*
+ * Access sampling. A kprobe on handle_mm_fault() feeds record_access() with
+ * the faults of tracked threads, which with NUMA balancing on include the
+ * periodic hinting faults. A scanner kthread starts tracking threads of
+ * processes that pass check_name(), drops the ones that have exited, and
+ * allocates the per-CPU deltas the probe asked for.
+ */
+#define SCAN_BATCH 256
+
+struct scan_entry {
+    pid_t pid, tgid;
+    bool leader;
+    char comm[TASK_COMM_LEN];
+};
+
+static struct scan_entry scan_buf[SCAN_BATCH];
+static struct task_struct *scanner;
+
+/*
+ * Threads the scanner will never track: every thread of a process whose
+ * comm is taken by a live tracked process, and threads past max_threads.
+ * An entry goes away with its task, so a recycled pid is looked at again,
+ * and all of them go when a tracked thread exits, as that may free a tid
+ * or a comm for them.
+ */
+#define IGNORED_HASH_BITS 8
+
+struct ignored_pid {
+    pid_t pid, tgid;
+    struct hlist_node node;
+};
+
+static DEFINE_HASHTABLE(ignored_pids, IGNORED_HASH_BITS);
+static DEFINE_PER_CPU(unsigned int, fault_count);
+
+static inline
+unsigned long fault_address(struct pt_regs *regs) {
+    /* handle_mm_fault(vma, address, flags) */
+#if defined(CONFIG_X86_64)
+    return regs->si;
+#elif defined(CONFIG_ARM64)
+    return regs->regs[1];
+#else
+    return 0;
+#endif
+}
+
+static int fault_pre_handler(struct kprobe *p, struct pt_regs *regs) {
+    unsigned long address = fault_address(regs);
+    unsigned int period = READ_ONCE(fault_sample_period);
+    struct c_thread_info *ti;
+
+    if (!address)
+        return 0;
+    rcu_read_lock();
+    ti = lookup_thread(current->pid);
+    // the pid may be recycled before the scanner sees the thread exit
+    if (ti && READ_ONCE(ti->pi->tgid) != current->tgid)
+        ti = NULL;
+    if (ti && (period <= 1 || !(this_cpu_inc_return(fault_count) % period)))
+        record_access(ti, address);
+    rcu_read_unlock();
+    return 0;
+}
+
+static struct kprobe fault_kprobe = {
+    .symbol_name = "handle_mm_fault",
+    .pre_handler = fault_pre_handler,
+};
+
+static void ignore_pid(pid_t pid, pid_t tgid) {
+    struct ignored_pid *ip = kmalloc(sizeof(*ip), GFP_KERNEL);
+
+    // without an entry we retry on the next scan, nothing worse
+    if (!ip)
+        return;
+    ip->pid = pid;
+    ip->tgid = tgid;
+    hash_add(ignored_pids, &ip->node, pid);
+}
+
+static bool pid_ignored(pid_t pid) {
+    struct ignored_pid *ip;
+
+    hash_for_each_possible(ignored_pids, ip, node, pid) {
+        if (ip->pid == pid)
+            return true;
+    }
+    return false;
+}
+
+// a pid is alive if it still names a thread of the process tgid
+static bool pid_alive(int pid, int tgid) {
+    struct task_struct *t;
+    bool alive;
+
+    rcu_read_lock();
+    t = pid_task(find_pid_ns(pid, &init_pid_ns), PIDTYPE_PID);
+    alive = t && t->tgid == tgid;
+    rcu_read_unlock();
+    return alive;
+}
+
+static void free_ignored(bool all) {
+    struct ignored_pid *ip;
+    struct hlist_node *tmp;
+    int bkt;
+
+    hash_for_each_safe(ignored_pids, bkt, tmp, ip, node) {
+        if (all || !pid_alive(ip->pid, ip->tgid)) {
+            hash_del(&ip->node);
+            kfree(ip);
+        }
+    }
+}
+
+static void scan_exited(void) {
+    struct process_info *pi;
+    struct list_head *curr;
+    bool removed = false;
+    int tid, pid;
+
+    list_for_each(curr, &process_list.list) {
+        pi = list_entry(curr, struct process_info, list);
+        for (tid = 0; tid < max_threads && atomic_read(&pi->nthreads); ++tid) {
+            pid = pi->pids[tid];
+            if (pid == -1)
+                continue;
+            if (!pid_alive(pid, pi->tgid)) {
+                remove_thread(pid);
+                removed = true;
+            }
+        }
+    }
+    free_ignored(removed);
+}
+
+static void scan_new(void) {
+    struct task_struct *g, *t;
+    int i, n = 0;
+
+    /* insert_* allocate, so collect under RCU and insert afterwards. */
+    rcu_read_lock();
+    for_each_process_thread(g, t) {
+        if (n == SCAN_BATCH)
+            break;
+        if (!check_name(g->comm) || lookup_thread(t->pid) ||
+            pid_ignored(g->pid) || pid_ignored(t->pid))
+            continue;
+        scan_buf[n].pid = t->pid;
+        scan_buf[n].tgid = g->pid;
+        scan_buf[n].leader = t == g;
+        strscpy(scan_buf[n].comm, g->comm, TASK_COMM_LEN);
+        ++n;
+    }
+    rcu_read_unlock();
+
+    /* Processes before their threads. */
+    for (i = 0; i < n; ++i) {
+        if (scan_buf[i].leader &&
+            insert_process(scan_buf[i].comm, scan_buf[i].pid) == -EEXIST)
+            ignore_pid(scan_buf[i].pid, scan_buf[i].tgid);
+    }
+    for (i = 0; i < n; ++i) {
+        if (!scan_buf[i].leader && !pid_ignored(scan_buf[i].tgid) &&
+            insert_thread(scan_buf[i].comm, scan_buf[i].tgid,
+                          scan_buf[i].pid) == -ENOSPC)
+            ignore_pid(scan_buf[i].pid, scan_buf[i].tgid);
+    }
+}
+
+// deltas for the cpus record_access() found without one since the last scan
+static void scan_deltas(void) {
+    struct list_head *curr;
+
+    list_for_each(curr, &process_list.list)
+        alloc_deltas(list_entry(curr, struct process_info, list));
+}
+
+static int scanner_fn(void *data) {
+    while (!kthread_should_stop()) {
+        mutex_lock(&process_lock);
+        scan_exited();
+        scan_new();
+        scan_deltas();
+        mutex_unlock(&process_lock);
+        msleep_interruptible(READ_ONCE(scan_interval_ms));
+    }
+    return 0;
+}
+
+int start_sampling(void) {
+    int ret;
+
+    scanner = kthread_run(scanner_fn, NULL, "clique_scan");
+    if (IS_ERR(scanner)) {
+        ret = PTR_ERR(scanner);
+        scanner = NULL;
+        return ret;
+    }
+
+    ret = register_kprobe(&fault_kprobe);
+    if (ret < 0) {
+        printk(KERN_ERR "register_kprobe failed, return %d", ret);
+        kthread_stop(scanner);
+        scanner = NULL;
+        return ret;
+    }
+    return 0;
+}
+
+void stop_sampling(void) {
+    if (!scanner)
+        return;
+    unregister_kprobe(&fault_kprobe);
+    kthread_stop(scanner);
+    scanner = NULL;
+    free_ignored(true);
+}
+
+// Placement daemon
+static struct task_struct *placer;
+
+static int placer_fn(void *data) {
+    while (!kthread_should_stop()) {
+        msleep_interruptible(READ_ONCE(place_interval_ms));
+        if (kthread_should_stop())
+            break;
+        mutex_lock(&process_lock);
+        place_processes();
+        mutex_unlock(&process_lock);
+    }
+    return 0;
+}
+
+int start_placer(void) {
+    placer = kthread_run(placer_fn, NULL, "clique_place");
+    if (IS_ERR(placer)) {
+        int ret = PTR_ERR(placer);
+        placer = NULL;
+        return ret;
+    }
+    return 0;
+}
+
+void stop_placer(void) {
+    if (!placer)
+        return;
+    kthread_stop(placer);
+    placer = NULL;
+}
 
 int init_module(void) {
-    // init_scheduler();
+    int ret;
+
+    ret = init_scheduler();
+    if (ret < 0)
+        return ret;
+    ret = start_sampling();
+    if (ret < 0) {
+        exit_scheduler();
+        return ret;
+    }
+    ret = start_placer();
+    if (ret < 0) {
+        stop_sampling();
+        exit_scheduler();
+        return ret;
+    }
+
     // insert_process("stress-ng", 1112);
-    // insert_thread("stress-ng", 1113);
-    // insert_thread("stress-ng", 1114);
+    // insert_thread("stress-ng", 1112, 1113);
+    // insert_thread("stress-ng", 1112, 1114);
 
     // print_processes();
 
     // insert_process("sysbench", 1120);
-    // insert_thread("sysbench", 1121);
-    // insert_thread("sysbench", 1122);
+    // insert_thread("sysbench", 1120, 1121);
+    // insert_thread("sysbench", 1120, 1122);
 
     // print_processes();
 
-    // remove_thread("sysbench", 1120);
-    // remove_thread("sysbench", 1121);
-    // remove_thread("sysbench", 1122);
+    // remove_thread(1120);
+    // remove_thread(1121);
+    // remove_thread(1122);
 
     // print_processes();
 
     // insert_process("sysbench", 1120);
-    // insert_thread("sysbench", 1121);
-    // insert_thread("sysbench", 1122);
+    // insert_thread("sysbench", 1120, 1121);
+    // insert_thread("sysbench", 1120, 1122);
 
     // print_processes();
     // exit_scheduler();
@@ -400,6 +1078,10 @@ int init_module(void) {
     return 0;
 }
 
-void cleanup_module(void) {}
+void cleanup_module(void) {
+    stop_placer();
+    stop_sampling();
+    exit_scheduler();
+}
 
 MODULE_LICENSE("GPL");
\ No newline at end of file
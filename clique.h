@@ -10,24 +10,50 @@
 #include <linux/slab.h>
 #include <linux/string.h>
 #include <linux/hashtable.h>
+#include <linux/jhash.h>
 #include <linux/sched.h>
+#include <linux/vmalloc.h>
+#include <linux/percpu.h>
+#include <linux/cpumask.h>
+#include <linux/bitmap.h>
+#include <linux/rhashtable.h>
 
 #include <asm/pgtable.h>
 #include <asm/uaccess.h>
 #include <asm/kvm_para.h>
 
 
-#define NTHREADS_SHIFT 6UL
-#define NTHREADS (1 << NTHREADS_SHIFT)
-#define SUBSCRIPT(x,y) (((x) << NTHREADS_SHIFT) + (y))
-#define C_PRINT
+/*
+ * A process has up to max_threads threads, a module parameter. Its
+ * communication matrix is kept in CM_SIDE x CM_SIDE blocks of one page each,
+ * allocated on first use, so threads that never share a page cost nothing.
+ */
+#define CM_SHIFT 5UL
+#define CM_SIDE (1 << CM_SHIFT)
+#define SUBSCRIPT(x,y) (((x) << CM_SHIFT) + (y))
+/* bounds the sharer bitmap of struct mem_acc */
+#define MAX_THREADS_LIMIT 4096U
+//#define C_PRINT
 #define VALID_ONLY
 
-#define PID_HASH_BITS 14UL
-#define PID_HASH_SIZE (1UL << PID_HASH_BITS)
-#define MEM_HASH_BITS 26UL
-#define MEM_HASH_SIZE (1UL << MEM_HASH_BITS)
 #define PN(addr) ((addr) >> 12UL)
+#define PROCESS_HASH_BITS 8
+
+/*
+ * Sharing is tracked for a sample of pages only, 1 in 2^mem_sample_shift,
+ * in a table of 2^mem_sets_shift sets of MEM_WAYS entries per process, LRU
+ * within a set. Both are module parameters. An entry holds a bitmap of
+ * max_threads bits, so the table takes about max_threads / 8 bytes per entry.
+ */
+#define MEM_WAYS 4
+#define MEM_SETS_SHIFT_MIN 4U
+#define MEM_SETS_SHIFT_MAX 22U
+/* Page 0 is never mapped, so a zeroed entry is empty. */
+#define MEM_PN_NONE 0UL
+
+extern unsigned int mem_sets_shift;
+extern unsigned int mem_sample_shift;
+extern unsigned int max_threads;
 
 
 //#define C_USEMAX
@@ -39,34 +65,107 @@
 		}																		\
 	}
 
+/* Members are chained through next_member in clique.c, in merge order. */
 struct clique {
-    int pids[NTHREADS];
+    int first, last;
     int size;
     enum {
         C_VALID, C_REUSE, C_INVALID
     } flag;
 };
 
+/* Every thread that has touched the page, bit i for tid i. */
 struct mem_acc {
-  short tids[2];
+  unsigned long pn;
+  /* pi->mem_clock at the last access, for LRU within the set */
+  unsigned int used;
+  unsigned long sharers[]; /* BITS_TO_LONGS(max_threads) */
+};
+
+struct cmatrix {
+	int nblocks; // per side
+	int *blocks[]; // nblocks * nblocks, NULL while all zero
 };
 
 struct process_info {
 	char comm[TASK_COMM_LEN];
 	atomic_t nthreads;
-	int matrix[NTHREADS * NTHREADS];
-	int pids[NTHREADS];
+	/* Sum of the per-CPU deltas, as of the last fold_matrix(). */
+	struct cmatrix *matrix;
+	/*
+	 * Only ever written by the owning CPU, by record_access(). NULL until
+	 * that CPU asks for it in delta_wanted and alloc_deltas() publishes it.
+	 */
+	struct cmatrix * __percpu *delta;
+	struct cpumask delta_wanted;
+	/* max_threads entries, -1 for a free tid */
+	int *pids;
 	struct list_head list;
 	struct mem_acc *mcs;
+	unsigned int mem_clock;
+	/* -1 and unhashed from process_tgids while the process has no threads */
+	int tgid;
+	/* A placement ran out of migration budget and goes on next round. */
+	bool placing;
+	struct hlist_node comm_node, tgid_node;
 };
 
+/*
+ * Tracked threads by pid. Lookups are RCU, so the fault path takes no lock;
+ * inserts and removals are serialized by the scanner.
+ */
 struct c_thread_info {
+	int pid;
 	struct process_info *pi;
 	short tid; // for indexing matrix
+	struct rhash_head node;
+	struct rcu_head rcu;
 };
 
-extern struct c_thread_info thread_list[1UL << PID_HASH_BITS];
+static const struct rhashtable_params thread_params = {
+	.key_len = sizeof(int),
+	.key_offset = offsetof(struct c_thread_info, pid),
+	.head_offset = offsetof(struct c_thread_info, node),
+	.automatic_shrinking = true,
+};
+
+extern struct rhashtable thread_table;
+/*
+ * All processes are on process_list, for walks, and in process_comms; those
+ * with threads are also in process_tgids. Only the scanner and the placement
+ * daemon use these, both under process_lock, so they are plain lists; the
+ * fault path reaches a process_info through thread_table only. A
+ * process_info is only freed on module exit.
+ */
 extern struct process_info process_list;
+extern struct hlist_head process_comms[1 << PROCESS_HASH_BITS];
+extern struct hlist_head process_tgids[1 << PROCESS_HASH_BITS];
+
+/* Caller holds rcu_read_lock() for as long as it uses the result. */
+static inline
+struct c_thread_info *lookup_thread(int pid) {
+	return rhashtable_lookup_fast(&thread_table, &pid, thread_params);
+}
+
+/*
+ * Enter pid into thread_table as thread tid of pi.
+ * @return 0, or -EEXIST if pid is already tracked.
+ */
+static inline
+int track_thread(struct process_info *pi, int pid, short tid) {
+	struct c_thread_info *ti = kmalloc(sizeof(*ti), GFP_KERNEL);
+	int ret;
+
+	if (!ti)
+		return -ENOMEM;
+	ti->pid = pid;
+	ti->pi = pi;
+	ti->tid = tid;
+	ret = rhashtable_lookup_insert_fast(&thread_table, &ti->node, thread_params);
+	if (ret)
+		kfree(ti);
+	return ret;
+}
 
 // static inline
 // void *resize(void *old, unsigned long old_size, unsigned long new_size) {
@@ -81,203 +180,408 @@ extern struct process_info process_list;
 static inline
 int check_name(char *comm) {
 	int len = strlen(comm);
+	if (len < 2)
+		return 0;
 	if (unlikely(comm[len - 2] == '.' && comm[len - 1] == 'x'))
 		return 1;
 	return 0;
 }
 
 
+static inline
+size_t mem_acc_stride(void) {
+	return sizeof(struct mem_acc) + BITS_TO_LONGS(max_threads) * sizeof(long);
+}
+
+static inline
+unsigned long mem_acc_size(void) {
+	return (mem_acc_stride() * MEM_WAYS) << mem_sets_shift;
+}
+
+static inline
+struct cmatrix *cm_alloc(void) {
+	int n = max_threads >> CM_SHIFT;
+	struct cmatrix *m = vzalloc(sizeof(*m) + sizeof(int *) * n * n);
+
+	BUILD_BUG_ON(sizeof(int) << (2 * CM_SHIFT) > PAGE_SIZE);
+	if (m)
+		m->nblocks = n;
+	return m;
+}
+
+static inline
+void cm_free(struct cmatrix *m) {
+	int i;
+
+	if (!m)
+		return;
+	for (i = 0; i < m->nblocks * m->nblocks; ++i)
+		free_page((unsigned long) m->blocks[i]);
+	vfree(m);
+}
+
+/* Blocks stay allocated, the thread that needed them may come back. */
+static inline
+void cm_clear(struct cmatrix *m) {
+	int i;
+
+	for (i = 0; i < m->nblocks * m->nblocks; ++i) {
+		if (m->blocks[i])
+			clear_page(m->blocks[i]);
+	}
+}
+
+static inline
+int **cm_block(struct cmatrix *m, int x, int y) {
+	return &m->blocks[(x >> CM_SHIFT) * m->nblocks + (y >> CM_SHIFT)];
+}
+
+static inline
+int cm_get(struct cmatrix *m, int x, int y) {
+	int *b = *cm_block(m, x, y);
+
+	return b ? b[SUBSCRIPT(x & (CM_SIDE - 1), y & (CM_SIDE - 1))] : 0;
+}
+
+/*
+ * Entry (x, y) of m, allocating its block if need be, or NULL if that fails.
+ * The block is zeroed before it is published for fold_matrix() to read.
+ */
+static inline
+int *cm_entry(struct cmatrix *m, int x, int y, gfp_t gfp) {
+	int **b = cm_block(m, x, y);
+	int *page = *b;
+
+	if (!page) {
+		page = (int *) get_zeroed_page(gfp);
+		if (!page)
+			return NULL;
+		smp_store_release(b, page);
+	}
+	return page + SUBSCRIPT(x & (CM_SIDE - 1), y & (CM_SIDE - 1));
+}
+
+static inline
+void free_process_info(struct process_info *pi) {
+	int cpu;
+
+	if (pi->delta) {
+		for_each_possible_cpu(cpu)
+			cm_free(*per_cpu_ptr(pi->delta, cpu));
+		free_percpu(pi->delta);
+	}
+	cm_free(pi->matrix);
+	kfree(pi->pids);
+	vfree(pi->mcs);
+	kfree(pi);
+}
+
 static inline
 void reset_process_info(struct process_info *pi) {
+	int cpu;
+
 	C_ASSERT(pi);
-	memset(pi->matrix, 0, sizeof(pi->matrix));
-	memset(pi->pids, -1, sizeof(pi->pids));
-	memset(pi->mcs, -1, sizeof(struct mem_acc) << MEM_HASH_BITS);
+	cm_clear(pi->matrix);
+	for_each_possible_cpu(cpu) {
+		if (*per_cpu_ptr(pi->delta, cpu))
+			cm_clear(*per_cpu_ptr(pi->delta, cpu));
+	}
+	memset(pi->pids, -1, sizeof(int) * max_threads);
+	memset(pi->mcs, 0, mem_acc_size());
 	atomic_set(&pi->nthreads, 0);
+	pi->placing = false;
+}
+
+static inline
+u32 comm_hash(const char *comm) {
+	return jhash(comm, strlen(comm), 0);
 }
 
 static inline
 struct process_info *search_process_info(char *comm) {
-	struct process_info *pi = NULL;
-	struct list_head *curr;
+	struct process_info *pi;
 	
-	list_for_each(curr, &process_list.list) {
-		pi = list_entry(curr, struct process_info, list);
-		if (!strcmp(pi->comm, comm)) {
+	hash_for_each_possible(process_comms, pi, comm_node, comm_hash(comm)) {
+		if (!strcmp(pi->comm, comm))
 			return pi;
-		}
 	}
 	return NULL;
 }
 
 static inline
-void insert_process(char *comm, int pid) {
+struct process_info *search_process_tgid(int tgid) {
+	struct process_info *pi;
+	
+	hash_for_each_possible(process_tgids, pi, tgid_node, tgid) {
+		if (pi->tgid == tgid)
+			return pi;
+	}
+	return NULL;
+}
+
+/*
+ * Start tracking the process comm led by pid.
+ * @return 0, or -EEXIST if a live process already has that comm.
+ */
+static inline
+int insert_process(char *comm, int pid) {
 	struct process_info *pi = search_process_info(comm);
-	int h;
+	int ret;
 	
 	if (pi) {
 		if (atomic_read(&pi->nthreads)) {
 			C_ASSERT(0);
 			printk(KERN_ERR "Duplicate process %s, %d", comm, pid);
-			return;
+			return -EEXIST;
 		} else {
 			printk("Reusing process %s, %d", comm, pid);
+			ret = track_thread(pi, pid, 0);
+			if (ret) {
+				printk(KERN_ERR "Cannot track process %s, %d: %d", comm, pid, ret);
+				return ret;
+			}
 			atomic_set(&pi->nthreads, 1);
 			pi->pids[0] = pid;
-			h = hash_32(pid, PID_HASH_BITS);
-			C_ASSERT(thread_list[h].pi == NULL);
-			thread_list[h].pi = pi;
-			thread_list[h].tid = 0;
-			return;
+			pi->tgid = pid;
+			hash_add(process_tgids, &pi->tgid_node, pid);
+			return 0;
 		}
 	}
 
 	pi = (struct process_info *)
-		kmalloc(sizeof(struct process_info), GFP_KERNEL);
+		kzalloc(sizeof(struct process_info), GFP_KERNEL);
 	C_ASSERT(pi != NULL);
+	if (!pi)
+		return -ENOMEM;
+
+	pi->mcs = (struct mem_acc *) vzalloc(mem_acc_size());
+	pi->pids = kmalloc_array(max_threads, sizeof(int), GFP_KERNEL);
+	pi->matrix = cm_alloc();
+	/* Zeroed, the deltas come with the first samples on each CPU. */
+	pi->delta = alloc_percpu(struct cmatrix *);
+	C_ASSERT(pi->mcs && pi->pids && pi->matrix && pi->delta);
+	if (!pi->mcs || !pi->pids || !pi->matrix || !pi->delta) {
+		free_process_info(pi);
+		return -ENOMEM;
+	}
+
+	ret = track_thread(pi, pid, 0);
+	if (ret) {
+		printk(KERN_ERR "Cannot track process %s, %d: %d", comm, pid, ret);
+		free_process_info(pi);
+		return ret;
+	}
 
 	strcpy(pi->comm, comm);
 	atomic_set(&pi->nthreads, 1);
-	memset(pi->matrix, 0, sizeof(pi->matrix));
-	memset(pi->pids, -1, sizeof(pi->pids));
+	memset(pi->pids, -1, sizeof(int) * max_threads);
 	
 	pi->pids[0] = pid;
+	pi->tgid = pid;
 	INIT_LIST_HEAD(&pi->list);
 	list_add(&pi->list, &process_list.list);
-
-	h = hash_32(pid, PID_HASH_BITS);
-	C_ASSERT(thread_list[h].pi == NULL);
-	thread_list[h].pi = pi;
-	thread_list[h].tid = 0;
-
-	// pi->mcs = (struct mem_acc *) vmalloc(sizeof(struct mem_acc) << MEM_HASH_BITS);
-	C_ASSERT(pi->mcs);
-	memset(pi->mcs, -1, sizeof(struct mem_acc) << MEM_HASH_BITS);
+	hash_add(process_comms, &pi->comm_node, comm_hash(comm));
+	hash_add(process_tgids, &pi->tgid_node, pid);
+	return 0;
 }
 
+/*
+ * Start tracking thread pid of the process tgid.
+ * @return 0, -ENOENT if the process is not tracked, or -ENOSPC if it
+ * already has max_threads threads.
+ */
 static inline
-void insert_thread(char *comm, int pid) {
-	int h = hash_32(pid, PID_HASH_BITS);
+int insert_thread(char *comm, int tgid, int pid) {
 	short tid;
-	struct process_info *pi = search_process_info(comm);
+	int ret;
+	struct process_info *pi = search_process_tgid(tgid);
 
 	if (!pi) {
 		C_ASSERT(pi != NULL);
 		printk(KERN_ERR "No process %s, %d", comm, pid);
-		return;
+		return -ENOENT;
 	}
 
-	if (thread_list[h].pi) {
-		C_ASSERT(thread_list[h].pi == NULL);
-		printk("Thread hash collision %s, %d", comm, pid);
-		return;
+	/* Reuse the tid of a thread that has exited. */
+	for (tid = 0; tid < max_threads && pi->pids[tid] != -1; ++tid)
+		;
+	if (tid == max_threads) {
+		printk(KERN_ERR "Too many threads %s, %d", comm, pid);
+		return -ENOSPC;
 	}
 
-	thread_list[h].pi = pi;
-	tid = atomic_inc_return(&pi->nthreads) - 1;
+	ret = track_thread(pi, pid, tid);
+	if (ret) {
+		printk(KERN_ERR "Cannot track thread %s, %d: %d", comm, pid, ret);
+		return ret;
+	}
+	atomic_inc(&pi->nthreads);
 
 	pi->pids[tid] = pid;
-	thread_list[h].tid = tid;
+	return 0;
 }
 
-void remove_thread(char *comm, int pid) {
-	int h = hash_32(pid, PID_HASH_BITS);
+void remove_thread(int pid) {
+	struct c_thread_info *ti;
 	short tid;
-	struct process_info *pi = NULL;
-	struct list_head *curr;
+	struct process_info *pi;
 	
-	list_for_each(curr, &process_list.list) {
-		pi = list_entry(curr, struct process_info, list);
-		if (!strcmp(pi->comm, comm)) {
-			break;
-		}
-	}
-
-	if (!pi) {
-		C_ASSERT(pi);
-		printk(KERN_ERR "No process %s, %d", comm, pid);
-		return;
-	}
-	if (!thread_list[h].pi) {
-		C_ASSERT(thread_list[h].pi);
-		printk(KERN_ERR "No process info %s, %d", comm, pid);
+	/* Only the scanner removes, so ti cannot go away under us. */
+	ti = rhashtable_lookup_fast(&thread_table, &pid, thread_params);
+	if (!ti) {
+		C_ASSERT(ti);
+		printk(KERN_ERR "No process info %d", pid);
 		return;
 	}
 	
-	thread_list[h].pi = NULL;
-	thread_list[h].tid = -1;
+	pi = ti->pi;
+	pi->pids[ti->tid] = -1;
+	rhashtable_remove_fast(&thread_table, &ti->node, thread_params);
+	kfree_rcu(ti, rcu);
 
 	tid = atomic_dec_return(&pi->nthreads);
 	if (unlikely(tid == 0)) {
+		hash_del(&pi->tgid_node);
+		pi->tgid = -1;
 		reset_process_info(pi);
 	}
 }
 
 
+/*
+ * Entry of the page in the sharing table, or NULL if the page is not sampled.
+ * A page that is not in its set replaces the least recently used entry.
+ */
 static inline
-int get_nshare(struct mem_acc *mc) {
-  if (mc->tids[0] == -1) {
-    if (mc->tids[1] == -1) {
-      return 0;
-    } else {
-      return 1;
-    }
-  } else {
-    if (mc->tids[1] == -1) {
-      return 1;
-    } else {
-      return 2;
-    }
-  }
+struct mem_acc *lookup_mem_acc(struct process_info *pi, unsigned long pn) {
+	u32 h = hash_long(pn, 32);
+	size_t stride = mem_acc_stride();
+	char *set;
+	struct mem_acc *mc, *lru = NULL;
+	int i;
+
+	if (h & ((1U << mem_sample_shift) - 1))
+		return NULL;
+	h >>= mem_sample_shift;
+	set = (char *) pi->mcs + (h & ((1U << mem_sets_shift) - 1)) * MEM_WAYS * stride;
+
+	for (i = 0; i < MEM_WAYS; ++i) {
+		mc = (struct mem_acc *) (set + i * stride);
+		if (mc->pn == pn)
+			break;
+		/* Ages are compared by difference, the clock may wrap. */
+		if (!lru || (int) (mc->used - lru->used) < 0)
+			lru = mc;
+	}
+	if (i == MEM_WAYS) {
+		mc = lru;
+		mc->pn = pn;
+		bitmap_zero(mc->sharers, max_threads);
+	}
+	mc->used = ++pi->mem_clock;
+	return mc;
 }
 
+/*
+ * Count one communication between x and y. Runs in the fault path, so a block
+ * that cannot be had without sleeping loses the sample.
+ */
 static inline
-void inc_matrix(int *matrix, int x, int y) {
-  ++matrix[SUBSCRIPT(x, y)];
-  matrix[SUBSCRIPT(x, y)] = matrix[SUBSCRIPT(y, x)];
+void inc_matrix(struct cmatrix *m, int x, int y) {
+  int *xy = cm_entry(m, x, y, GFP_NOWAIT | __GFP_NOWARN);
+  int *yx = cm_entry(m, y, x, GFP_NOWAIT | __GFP_NOWARN);
+
+  if (xy && yx) {
+    ++*xy;
+    ++*yx;
+  }
 }
 
+/* Caller holds rcu_read_lock(), under which it looked up ti. */
 static inline
-void record_access(int pid, unsigned long address) {
-  int h = hash_32(pid, PID_HASH_BITS);
-  struct process_info *pi = thread_list[h].pi;
-  short tid = thread_list[h].tid;
+void record_access(struct c_thread_info *ti, unsigned long address) {
+  struct process_info *pi = ti->pi;
+  short tid = ti->tid;
   struct mem_acc *mc;
+  struct cmatrix *m;
+  int j, cpu;
 
   C_ASSERT(pi);
-  mc = &pi->mcs[hash_32(PN(address), MEM_HASH_BITS)];
-
-  switch(get_nshare(mc)) {
-    case 0: {
-      mc->tids[0] = tid;
-      break;
+  /*
+   * The sharing table takes no lock either: CPUs racing on one set can only
+   * misattribute a sample.
+   */
+  mc = lookup_mem_acc(pi, PN(address));
+  if (!mc)
+    return;
+
+  cpu = get_cpu();
+  m = smp_load_acquire(per_cpu_ptr(pi->delta, cpu));
+  /* The fault path cannot allocate a directory, the scanner will. */
+  if (!m)
+    cpumask_set_cpu(cpu, &pi->delta_wanted);
+  if (m) {
+    for_each_set_bit(j, mc->sharers, max_threads) {
+      if (j != tid)
+        inc_matrix(m, tid, j);
     }
+  }
+  put_cpu();
 
-    case 1: {
-      if (mc->tids[0] != tid) {
-        mc->tids[1] = mc->tids[0];
-        mc->tids[0] = tid;
-        inc_matrix(pi->matrix, tid, mc->tids[1]);
-      }
+  if (!test_bit(tid, mc->sharers))
+    set_bit(tid, mc->sharers);
+}
+
+/*
+ * Give the CPUs that sampled pi without a delta one. Called from the scanner,
+ * which may sleep.
+ */
+static inline
+void alloc_deltas(struct process_info *pi) {
+  struct cmatrix *m;
+  int cpu;
+
+  for_each_cpu(cpu, &pi->delta_wanted) {
+    cpumask_clear_cpu(cpu, &pi->delta_wanted);
+    if (*per_cpu_ptr(pi->delta, cpu))
+      continue;
+    m = cm_alloc();
+    if (!m)
       break;
-    }
+    smp_store_release(per_cpu_ptr(pi->delta, cpu), m);
+  }
+}
 
-    case 2: {
-      if (mc->tids[0] != tid) {
-        if (mc->tids[1] != tid) {
-          inc_matrix(pi->matrix, tid, mc->tids[0]);
-          inc_matrix(pi->matrix, tid, mc->tids[1]);
-        } else {
-          inc_matrix(pi->matrix, tid, mc->tids[0]);
-          mc->tids[1] = mc->tids[0];
-          mc->tids[0] = tid;
-        }
-      } else if (mc->tids[1] != tid) {
-        inc_matrix(pi->matrix, tid, mc->tids[1]);
+/*
+ * Sum the per-CPU deltas into pi->matrix before analysis. The deltas are
+ * never cleared while threads run, so a concurrent record_access() is at
+ * worst missed until the next fold.
+ */
+static inline
+void fold_matrix(struct process_info *pi) {
+  struct cmatrix *delta;
+  int cpu, b, i, *src, *dst;
+
+  cm_clear(pi->matrix);
+  for_each_possible_cpu(cpu) {
+    delta = smp_load_acquire(per_cpu_ptr(pi->delta, cpu));
+    if (!delta)
+      continue;
+    for (b = 0; b < delta->nblocks * delta->nblocks; ++b) {
+      src = smp_load_acquire(&delta->blocks[b]);
+      if (!src)
+        continue;
+      dst = pi->matrix->blocks[b];
+      if (!dst) {
+        dst = (int *) get_zeroed_page(GFP_KERNEL);
+        if (!dst)
+          continue;
+        pi->matrix->blocks[b] = dst;
       }
+      for (i = 0; i < CM_SIDE * CM_SIDE; ++i)
+        dst[i] += READ_ONCE(src[i]);
     }
-  } 
+  }
 }
 
-
 #endif
\ No newline at end of file
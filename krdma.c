@@ -22,6 +22,10 @@
 #include <linux/inet.h>
 #include <linux/proc_fs.h>
 #include <linux/kthread.h>
+#include <linux/vmalloc.h>
+#include <linux/hashtable.h>
+#include <linux/jhash.h>
+#include <linux/workqueue.h>
 // #include <linux/kvm_host.h>
 
 #include "krdma.h"
@@ -52,6 +56,7 @@ static int __krdma_bound_dev_remote(struct krdma_cb *cb, const char *host, const
 static int __krdma_bound_dev_local(struct krdma_cb *cb, const char *host, const char *port);
 
 /* Allocate cb->pd, cb->cq, cb->qp, mr, freed by caller */
+static int __krdma_init_cb(struct krdma_cb *cb);
 static int krdma_init_cb(struct krdma_cb *cb);
 /* Deallocate cb->cm_id, cb->pd, cb->cq, cb->qp, mr */
 int krdma_release_cb(struct krdma_cb *cb);
@@ -61,6 +66,13 @@ static int __krdma_connect(struct krdma_cb *cb);
 static int __krdma_listen(struct krdma_cb *cb);
 static int __krdma_accept(struct krdma_cb *cb);
 
+/* Start reconnecting a resilient cb in the background */
+static void krdma_schedule_reconnect(struct krdma_cb *cb, int gen);
+
+/* Hand a new accept cb to the accept engine, if any */
+static bool krdma_accept_engine_queue(struct krdma_cb *listen_cb,
+		struct krdma_cb *cb);
+
 /* wait for rdma_cm RDMA_CM_EVENT_CONNECT_REQUEST */
 static struct krdma_cb *__krdma_wait_for_connect_request(struct krdma_cb *listen_cb);
 
@@ -83,6 +95,20 @@ static int krdma_set_addr(struct sockaddr_in *addr, const char *host, const char
 	return 0;
 }
 
+/* event->param.conn.private_data is only valid inside the event handler. */
+static void krdma_save_peer_priv(struct krdma_cb *cb,
+		struct rdma_cm_event *event)
+{
+	uint8_t len = event->param.conn.private_data_len;
+
+	if (!event->param.conn.private_data || len == 0)
+		return;
+	if (len > KRDMA_PRIV_DATA_MAX)
+		len = KRDMA_PRIV_DATA_MAX;
+	memcpy(cb->peer_priv, event->param.conn.private_data, len);
+	cb->peer_priv_len = len;
+}
+
 static int krdma_cma_event_handler(struct rdma_cm_id *cm_id,
 		struct rdma_cm_event *event)
 {
@@ -116,7 +142,18 @@ static int krdma_cma_event_handler(struct rdma_cm_id *cm_id,
 		if (!ret) {
 			conn_cb->cm_id = cm_id;
 			cm_id->context = conn_cb;
+			krdma_save_peer_priv(conn_cb, event);
+			conn_cb->read_write = cb->read_write;
+			conn_cb->listen_cb = cb;
+			/*
+			 * Only wake krdma_accept() for requests it will pick up,
+			 * stale completions would let its next wait return early.
+			 */
+			if (krdma_accept_engine_queue(cb, conn_cb))
+				return 0;
+			spin_lock(&cb->conn_lock);
 			list_add_tail(&conn_cb->list, &cb->ready_conn);
+			spin_unlock(&cb->conn_lock);
 		} else {
 			krdma_err("__krdma_create_cb fail, ret %d\n", ret);
 			cb->state = KRDMA_ERROR;
@@ -126,12 +163,17 @@ static int krdma_cma_event_handler(struct rdma_cm_id *cm_id,
 	case RDMA_CM_EVENT_ESTABLISHED:
 		krdma_debug("%s: RDMA_CM_EVENT_ESTABLISHED, cm_id %p\n",
 				__func__, cm_id);
+		/* The client gets the server's descriptor with the reply. */
+		if (cb->role == KRDMA_CLIENT_CONN)
+			krdma_save_peer_priv(cb, event);
 		cb->state = KRDMA_CONNECTED;
 		break;
 
 	case RDMA_CM_EVENT_DISCONNECTED:
 		krdma_debug(KERN_ERR "%s: RDMA_CM_EVENT_DISCONNECTED, cm_id %p\n",
 				__func__, cm_id);
+		if (cb->state == KRDMA_CONNECTED && cb->resilient)
+			krdma_schedule_reconnect(cb, atomic_read(&cb->conn_gen));
 		cb->state = KRDMA_DISCONNECTED;
 		break;
 
@@ -333,10 +375,19 @@ static int __krdma_free_mr_sr(struct krdma_cb *cb)
 	return 0;
 }
 
+static void __krdma_rw_free_twin(struct krdma_cb *cb) {
+	vfree(cb->mr.rw_mr.twin);
+	cb->mr.rw_mr.twin = NULL;
+	cb->mr.rw_mr.twin_valid = false;
+	kfree(cb->mr.rw_mr.delta_wrs);
+	cb->mr.rw_mr.delta_wrs = NULL;
+}
+
 static int __krdma_free_mr_rw(struct krdma_cb *cb) {
 	int ret = 0;
 
 	kfree(cb->mr.rw_mr.local_info->buf);
+	__krdma_rw_free_twin(cb);
 	kfree(cb->mr.rw_mr.remote_info);
 	cb->mr.rw_mr.remote_info = NULL;
 	kfree(cb->mr.rw_mr.local_info);
@@ -360,6 +411,12 @@ static int krdma_connect_single(const char *host, const char *port,
 	if (host == NULL || port == NULL || cb == NULL)
 		return -EINVAL;
 
+	/* Remembered for reconnection. */
+	if (cb->host != host) {
+		strscpy(cb->host, host, sizeof(cb->host));
+		strscpy(cb->port, port, sizeof(cb->port));
+	}
+
 	ret = __krdma_bound_dev_remote(cb, host, port);
 	if (ret)
 		return ret;
@@ -416,7 +473,7 @@ retry:
 				++cb->retry_count < RDMA_CONNECT_RETRY_MAX) {
 		krdma_err("krdma_connect_single failed, retry_count %d, " \
 				"reconnecting...\n", cb->retry_count);
-		msleep(1000);
+		msleep(RDMA_CONNECT_RETRY_DELAY);
 		goto retry;
 	}
 	__krdma_free_cb(cb);
@@ -424,13 +481,122 @@ retry:
 	krdma_err("krdma_connect_single failed, ret: %d\n", ret);
 	return ret;
 }
+EXPORT_SYMBOL_GPL(krdma_connect);
+
+struct krdma_mesh {
+	struct workqueue_struct *wq;
+	atomic_t pending;
+	struct completion done;
+};
+
+struct krdma_mesh_conn {
+	struct delayed_work work;
+	struct krdma_mesh *mesh;
+	struct krdma_peer *peer;
+	struct krdma_cb *cb;
+};
+
+/* One connection attempt, rescheduled instead of sleeping on CLIENT_RETRY. */
+static void krdma_mesh_connect_work(struct work_struct *work)
+{
+	int ret;
+	struct krdma_mesh_conn *conn = container_of(to_delayed_work(work),
+			struct krdma_mesh_conn, work);
+	struct krdma_peer *peer = conn->peer;
+
+	if (!conn->cb) {
+		ret = __krdma_create_cb(&conn->cb, KRDMA_CLIENT_CONN);
+		if (ret) {
+			krdma_err("__krdma_create_cb fail, ret %d\n", ret);
+			goto done;
+		}
+		conn->cb->read_write = peer->read_write;
+	}
+
+	ret = krdma_connect_single(peer->host, peer->port, conn->cb);
+	if (ret == 0) {
+		krdma_debug("%p connected to %s:%s\n", conn->cb, peer->host,
+				peer->port);
+		peer->cb = conn->cb;
+		goto done;
+	}
+	if (ret == -CLIENT_RETRY &&
+				++conn->cb->retry_count < RDMA_CONNECT_RETRY_MAX) {
+		krdma_err("connect to %s:%s failed, retry_count %d, " \
+				"reconnecting...\n", peer->host, peer->port,
+				conn->cb->retry_count);
+		queue_delayed_work(conn->mesh->wq, &conn->work,
+				msecs_to_jiffies(RDMA_CONNECT_RETRY_DELAY));
+		return;
+	}
+	krdma_err("connect to %s:%s failed, ret: %d\n", peer->host, peer->port,
+			ret);
+	__krdma_free_cb(conn->cb);
+	conn->cb = NULL;
+
+done:
+	peer->ret = ret;
+	if (atomic_dec_and_test(&conn->mesh->pending))
+		complete(&conn->mesh->done);
+}
+
+int krdma_connect_mesh(struct krdma_peer *peers, int nr_peers)
+{
+	int i, failed = 0;
+	struct krdma_mesh mesh;
+	struct krdma_mesh_conn *conns;
+
+	if (peers == NULL || nr_peers <= 0)
+		return -EINVAL;
+
+	conns = kcalloc(nr_peers, sizeof(*conns), GFP_KERNEL);
+	if (!conns)
+		return -ENOMEM;
+
+	/* One worker per peer, so that the handshakes overlap. */
+	mesh.wq = alloc_workqueue("krdma_mesh", WQ_UNBOUND, nr_peers);
+	if (!mesh.wq) {
+		kfree(conns);
+		return -ENOMEM;
+	}
+	atomic_set(&mesh.pending, nr_peers);
+	init_completion(&mesh.done);
+
+	for (i = 0; i < nr_peers; i++) {
+		peers[i].cb = NULL;
+		peers[i].ret = -EINPROGRESS;
+		conns[i].mesh = &mesh;
+		conns[i].peer = &peers[i];
+		INIT_DELAYED_WORK(&conns[i].work, krdma_mesh_connect_work);
+		queue_delayed_work(mesh.wq, &conns[i].work, 0);
+	}
+
+	wait_for_completion(&mesh.done);
+	destroy_workqueue(mesh.wq);
+	kfree(conns);
+
+	for (i = 0; i < nr_peers; i++) {
+		if (peers[i].ret < 0)
+			failed++;
+	}
+	krdma_debug("mesh connected %d/%d peers\n", nr_peers - failed, nr_peers);
+	return failed;
+}
+EXPORT_SYMBOL_GPL(krdma_connect_mesh);
 
 int krdma_listen(const char *host, const char *port, struct krdma_cb **listen_cb)
+{
+	return krdma_listen_backlog(host, port, RDMA_LISTEN_BACKLOG, listen_cb);
+}
+EXPORT_SYMBOL_GPL(krdma_listen);
+
+int krdma_listen_backlog(const char *host, const char *port, int backlog,
+		struct krdma_cb **listen_cb)
 {
 	int ret;
 	struct krdma_cb *cb;
 
-	if (host == NULL || port == NULL || listen_cb == NULL)
+	if (host == NULL || port == NULL || listen_cb == NULL || backlog <= 0)
 		return -EINVAL;
 
 	ret = __krdma_create_cb(listen_cb, KRDMA_LISTEN_CONN);
@@ -440,6 +606,7 @@ int krdma_listen(const char *host, const char *port, struct krdma_cb **listen_cb
 	}
 	cb = *listen_cb;
 	cb->read_write = false;
+	cb->backlog = backlog;
 
 	ret = __krdma_bound_dev_local(cb, host, port);
 	if (ret < 0)
@@ -459,11 +626,14 @@ out_free_cb:
 	*listen_cb = NULL;
 	return ret;
 }
+EXPORT_SYMBOL_GPL(krdma_listen_backlog);
 
 static struct krdma_cb *__krdma_wait_for_connect_request(struct krdma_cb *listen_cb) {
 	struct krdma_cb *cb;
 
+	spin_lock(&listen_cb->conn_lock);
 	while (list_empty(&listen_cb->ready_conn)) {
+		spin_unlock(&listen_cb->conn_lock);
 		wait_for_completion_interruptible(&listen_cb->cm_done);
 		if (listen_cb->state == KRDMA_ERROR) {
 			krdma_err("rdma_listen cancel\n");
@@ -471,18 +641,130 @@ static struct krdma_cb *__krdma_wait_for_connect_request(struct krdma_cb *listen
 		}
 		if (kthread_should_stop())
 			goto exit;
+		spin_lock(&listen_cb->conn_lock);
 	}
 
 	/* Pick a ready connnection. */
 	cb = list_first_entry(&listen_cb->ready_conn, struct krdma_cb, list);
 	list_del(&cb->list);
 	list_add_tail(&cb->list, &listen_cb->active_conn);
+	spin_unlock(&listen_cb->conn_lock);
 	return cb;
 
 exit:
 	return NULL;
 }
 
+struct krdma_accept_engine {
+	struct workqueue_struct *wq;
+	struct krdma_cb *listen_cb;
+	krdma_accept_fn_t fn;
+	void *data;
+};
+
+static void krdma_accept_work(struct work_struct *work)
+{
+	int ret;
+	struct krdma_cb *cb = container_of(work, struct krdma_cb, accept_work);
+	struct krdma_accept_engine *engine = cb->accept_engine;
+	struct krdma_cb *listen_cb = engine->listen_cb;
+
+	krdma_debug("get connection, cm_id %p\n", cb->cm_id);
+
+	ret = krdma_init_cb(cb);
+	if (ret < 0) {
+		rdma_reject(cb->cm_id, NULL, 0);
+		rdma_destroy_id(cb->cm_id);
+		cb->cm_id = NULL;
+		goto out_free_cb;
+	}
+
+	ret = __krdma_accept(cb);
+	if (ret < 0)
+		goto out_release_cb;
+
+	ret = engine->fn(cb, engine->data);
+	if (ret == 0)
+		return;
+
+out_release_cb:
+	krdma_release_cb(cb);
+out_free_cb:
+	krdma_err("accept cb %p failed, ret %d\n", cb, ret);
+	spin_lock(&listen_cb->conn_lock);
+	list_del(&cb->list);
+	spin_unlock(&listen_cb->conn_lock);
+	__krdma_free_cb(cb);
+}
+
+/* Called from the cm event handler on RDMA_CM_EVENT_CONNECT_REQUEST. */
+static bool krdma_accept_engine_queue(struct krdma_cb *listen_cb,
+		struct krdma_cb *cb)
+{
+	bool queued = false;
+
+	spin_lock(&listen_cb->conn_lock);
+	if (listen_cb->accept_engine) {
+		cb->accept_engine = listen_cb->accept_engine;
+		INIT_WORK(&cb->accept_work, krdma_accept_work);
+		list_add_tail(&cb->list, &listen_cb->active_conn);
+		queued = queue_work(listen_cb->accept_engine->wq, &cb->accept_work);
+	}
+	spin_unlock(&listen_cb->conn_lock);
+	return queued;
+}
+
+int krdma_accept_engine_start(struct krdma_cb *listen_cb, int nr_workers,
+		krdma_accept_fn_t fn, void *data)
+{
+	struct krdma_accept_engine *engine;
+
+	if (listen_cb == NULL || listen_cb->role != KRDMA_LISTEN_CONN ||
+			fn == NULL || nr_workers <= 0)
+		return -EINVAL;
+	if (listen_cb->accept_engine)
+		return -EBUSY;
+
+	engine = kzalloc(sizeof(*engine), GFP_KERNEL);
+	if (!engine)
+		return -ENOMEM;
+	engine->wq = alloc_workqueue("krdma_accept", WQ_UNBOUND, nr_workers);
+	if (!engine->wq) {
+		kfree(engine);
+		return -ENOMEM;
+	}
+	engine->listen_cb = listen_cb;
+	engine->fn = fn;
+	engine->data = data;
+
+	spin_lock(&listen_cb->conn_lock);
+	listen_cb->accept_engine = engine;
+	spin_unlock(&listen_cb->conn_lock);
+	krdma_debug("accept engine started with %d workers\n", nr_workers);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(krdma_accept_engine_start);
+
+void krdma_accept_engine_stop(struct krdma_cb *listen_cb)
+{
+	struct krdma_accept_engine *engine;
+
+	if (listen_cb == NULL)
+		return;
+
+	spin_lock(&listen_cb->conn_lock);
+	engine = listen_cb->accept_engine;
+	listen_cb->accept_engine = NULL;
+	spin_unlock(&listen_cb->conn_lock);
+	if (!engine)
+		return;
+
+	/* Let requests being accepted finish. */
+	destroy_workqueue(engine->wq);
+	kfree(engine);
+}
+EXPORT_SYMBOL_GPL(krdma_accept_engine_stop);
+
 int krdma_accept(struct krdma_cb *listen_cb, struct krdma_cb **accept_cb)
 {
 	int ret = 0;
@@ -526,53 +808,241 @@ out_release_cb:
 	krdma_release_cb(cb);
 
 out_free_cb:
+	spin_lock(&listen_cb->conn_lock);
+	list_del(&cb->list);
+	spin_unlock(&listen_cb->conn_lock);
 	__krdma_free_cb(cb);
 	*accept_cb = NULL;
 
 exit:
 	return ret;
 }
+EXPORT_SYMBOL_GPL(krdma_accept);
 
-int krdma_release_cb(struct krdma_cb *cb)
+/* Deallocate cb->cm_id, cb->pd, cb->cq, cb->qp, mr, keep the cb usable */
+static void __krdma_teardown_cb(struct krdma_cb *cb)
 {
-	struct krdma_cb *entry = NULL;
-	struct krdma_cb *this = NULL;
-
-	if (cb == NULL)
-		return -EINVAL;
-
-	if (!cb->cm_id)
-		return -EINVAL;
-
 	rdma_disconnect(cb->cm_id);
 	if (cb->cm_id->qp)
 		rdma_destroy_qp(cb->cm_id);
+	cb->qp = NULL;
 
 	krdma_free_mr(cb);
 	if (cb->send_cq)
 		ib_destroy_cq(cb->send_cq);
+	cb->send_cq = NULL;
 	if (cb->recv_cq)
 		ib_destroy_cq(cb->recv_cq);
+	cb->recv_cq = NULL;
 
 	if (cb->pd)
 		ib_dealloc_pd(cb->pd);
+	cb->pd = NULL;
 
 	rdma_destroy_id(cb->cm_id);
 	cb->cm_id = NULL;
+}
+
+int krdma_release_cb(struct krdma_cb *cb)
+{
+	struct krdma_cb *entry = NULL;
+	struct krdma_cb *this = NULL;
+
+	if (cb == NULL)
+		return -EINVAL;
+
+	if (cb->resilient) {
+		cb->resilient = false;
+		cancel_work_sync(&cb->reconnect_work);
+		complete_all(&cb->reconnected);
+	}
+
+	if (!cb->cm_id)
+		return -EINVAL;
+
+	__krdma_teardown_cb(cb);
 
 	if (cb->role == KRDMA_LISTEN_CONN) {
+		krdma_accept_engine_stop(cb);
+		/* Never handed out, so nobody else will free them. */
 		list_for_each_entry_safe(entry, this, &cb->ready_conn, list) {
 			krdma_release_cb(entry);
 			list_del(&entry->list);
+			__krdma_free_cb(entry);
 		}
+		/* Their owners still krdma_free_cb() them. */
+		spin_lock(&cb->conn_lock);
 		list_for_each_entry_safe(entry, this, &cb->active_conn, list) {
-			krdma_release_cb(entry);
-			list_del(&entry->list);
+			list_del_init(&entry->list);
+			entry->listen_cb = NULL;
 		}
+		spin_unlock(&cb->conn_lock);
 	}
 
 	return 0;
 }
+EXPORT_SYMBOL_GPL(krdma_release_cb);
+
+int krdma_free_cb(struct krdma_cb *cb)
+{
+	struct krdma_cb *listen_cb;
+
+	if (cb == NULL)
+		return -EINVAL;
+
+	krdma_release_cb(cb);
+	listen_cb = cb->listen_cb;
+	if (listen_cb) {
+		spin_lock(&listen_cb->conn_lock);
+		list_del(&cb->list);
+		spin_unlock(&listen_cb->conn_lock);
+	}
+	__krdma_free_cb(cb);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(krdma_free_cb);
+
+static int __krdma_rw_alloc_twin(struct krdma_cb *cb);
+
+/*
+ * Connect cb again to its remembered host and port. Unlike
+ * krdma_connect_single(), a failure only tears the cb down: releasing it
+ * would cancel the reconnect work we run on.
+ * The caller holds cb->slock and cb->rlock.
+ */
+static int krdma_reconnect_single(struct krdma_cb *cb)
+{
+	int ret;
+
+	ret = __krdma_bound_dev_remote(cb, cb->host, cb->port);
+	if (ret)
+		return ret;
+
+	ret = __krdma_init_cb(cb);
+	if (ret < 0) {
+		rdma_destroy_id(cb->cm_id);
+		cb->cm_id = NULL;
+		return ret;
+	}
+
+	ret = __krdma_connect(cb);
+	if (ret < 0)
+		__krdma_teardown_cb(cb);
+	return ret;
+}
+
+static void krdma_reconnect_work(struct work_struct *work)
+{
+	int ret = -ENOTCONN;
+	int retry;
+	bool delta;
+	unsigned long deadline;
+	struct krdma_cb *cb = container_of(work, struct krdma_cb, reconnect_work);
+
+	/* Requests release the locks while waiting for us. */
+	mutex_lock(&cb->slock);
+	mutex_lock(&cb->rlock);
+
+	delta = cb->read_write && cb->mr.rw_mr.twin;
+	if (cb->cm_id)
+		__krdma_teardown_cb(cb);
+
+	/*
+	 * Waiters give up after KRDMA_RECONNECT_TIMEOUT, so do not start an
+	 * attempt that may not resolve the address and route before then.
+	 */
+	deadline = jiffies + msecs_to_jiffies(KRDMA_RECONNECT_TIMEOUT -
+			KRDMA_RECONNECT_ATTEMPT);
+	for (retry = 0; retry < KRDMA_RECONNECT_RETRY_MAX && cb->resilient; retry++) {
+		/* Drop completions of events of the old cm_id. */
+		reinit_completion(&cb->cm_done);
+		cb->state = KRDMA_INIT;
+		cb->peer_priv_len = 0;
+		ret = krdma_reconnect_single(cb);
+		if (ret == 0)
+			break;
+		krdma_err("cb %p reconnect to %s:%s failed, ret %d, retry_count %d\n",
+				cb, cb->host, cb->port, ret, retry);
+		if (!time_before(jiffies + msecs_to_jiffies(50 << retry), deadline))
+			break;
+		msleep(50 << retry);
+	}
+	if (ret == 0 && delta)
+		ret = __krdma_rw_alloc_twin(cb);
+
+	krdma_debug("cb %p reconnect to %s:%s, ret %d\n", cb, cb->host, cb->port,
+			ret);
+	cb->reconnect_ret = ret;
+	if (ret == 0)
+		atomic_inc(&cb->conn_gen);
+	/* The new generation is seen by whoever sees reconnecting cleared. */
+	smp_wmb();
+	atomic_set(&cb->reconnecting, 0);
+	complete_all(&cb->reconnected);
+
+	mutex_unlock(&cb->rlock);
+	mutex_unlock(&cb->slock);
+}
+
+/*
+ * Reconnect cb if it is still at generation gen, the one a failed request
+ * was posted on. A request that failed on a connection since replaced must
+ * not tear down its healthy successor.
+ */
+static void krdma_schedule_reconnect(struct krdma_cb *cb, int gen)
+{
+	if (atomic_cmpxchg(&cb->reconnecting, 0, 1) != 0)
+		return;
+	if (atomic_read(&cb->conn_gen) != gen) {
+		atomic_set(&cb->reconnecting, 0);
+		return;
+	}
+	reinit_completion(&cb->reconnected);
+	queue_work(system_unbound_wq, &cb->reconnect_work);
+}
+
+static bool krdma_conn_error(int ret)
+{
+	return ret == -EPIPE || ret == -STATE_ERROR || ret == -ENOTCONN;
+}
+
+/*
+ * Called without cb->slock and cb->rlock after a request posted on
+ * generation gen of the connection failed with ret.
+ * @return 0 if the request can be replayed on a reconnected cb.
+ */
+static int krdma_wait_reconnect(struct krdma_cb *cb, int ret, int gen)
+{
+	if (!cb->resilient || !krdma_conn_error(ret))
+		return ret;
+
+	krdma_schedule_reconnect(cb, gen);
+	/* Already reconnected since, retry on the new connection. */
+	if (!atomic_read(&cb->reconnecting) && atomic_read(&cb->conn_gen) != gen)
+		return 0;
+	if (!wait_for_completion_timeout(&cb->reconnected,
+				msecs_to_jiffies(KRDMA_RECONNECT_TIMEOUT))) {
+		krdma_err("cb %p reconnect timed out\n", cb);
+		return -ETIMEDOUT;
+	}
+	return cb->resilient ? cb->reconnect_ret : ret;
+}
+
+int krdma_set_resilient(struct krdma_cb *cb, bool enable)
+{
+	if (cb == NULL || cb->role != KRDMA_CLIENT_CONN)
+		return -EINVAL;
+
+	if (!enable && cb->resilient) {
+		cb->resilient = false;
+		cancel_work_sync(&cb->reconnect_work);
+		complete_all(&cb->reconnected);
+		return 0;
+	}
+	cb->resilient = enable;
+	return 0;
+}
+EXPORT_SYMBOL_GPL(krdma_set_resilient);
 
 static int __krdma_create_cb(struct krdma_cb **cbp, enum krdma_role role)
 {
@@ -584,12 +1054,15 @@ static int __krdma_create_cb(struct krdma_cb **cbp, enum krdma_role role)
 	init_completion(&cb->cm_done);
 
 	cb->role = role;
+	spin_lock_init(&cb->conn_lock);
 	if (cb->role == KRDMA_LISTEN_CONN) {
 		INIT_LIST_HEAD(&cb->ready_conn);
 		INIT_LIST_HEAD(&cb->active_conn);
 	}
 	mutex_init(&cb->slock);
 	mutex_init(&cb->rlock);
+	INIT_WORK(&cb->reconnect_work, krdma_reconnect_work);
+	init_completion(&cb->reconnected);
 
 	if (cbp)
 		*cbp = cb;
@@ -702,7 +1175,8 @@ exit:
  * Called after __krdma_bound_dev_{local, remote}.
  * Allocate pd, cq, qp, mr, freed by caller
  */
-static int krdma_init_cb(struct krdma_cb *cb) {
+/* The caller holds cb->rlock, which guards the recv buffers we post. */
+static int __krdma_init_cb(struct krdma_cb *cb) {
 	int ret;
 	struct ib_cq_init_attr cq_attr;
 	struct ib_qp_init_attr qp_init_attr;
@@ -742,7 +1216,8 @@ static int krdma_init_cb(struct krdma_cb *cb) {
 
 	/* Create Queue Pair. */
 	memset(&qp_init_attr, 0, sizeof(qp_init_attr));
-	qp_init_attr.cap.max_send_wr = RDMA_SEND_QUEUE_DEPTH;
+	qp_init_attr.cap.max_send_wr = cb->read_write ?
+		RDMA_RW_QUEUE_DEPTH : RDMA_SEND_QUEUE_DEPTH;
 	qp_init_attr.cap.max_recv_wr = RDMA_RECV_QUEUE_DEPTH;
 	qp_init_attr.cap.max_recv_sge = 1;
 	qp_init_attr.cap.max_send_sge = 1;
@@ -767,14 +1242,15 @@ static int krdma_init_cb(struct krdma_cb *cb) {
 		goto free_qp;
 	}
 
-	mutex_lock(&cb->rlock);
+	/* Read/write cbs have no recv_trans_buf to post. */
+	if (cb->read_write)
+		return 0;
+
 	ret = krdma_post_recv(cb);
 	if (ret) {
 		krdma_err("krdma_post_recv failed, ret %d\n", ret);
-		mutex_unlock(&cb->rlock);
 		goto free_buffers;
 	}
-	mutex_unlock(&cb->rlock);
 	return 0;
 
 free_buffers:
@@ -791,9 +1267,25 @@ exit:
 	return ret;
 }
 
+static int krdma_init_cb(struct krdma_cb *cb) {
+	int ret;
+
+	mutex_lock(&cb->rlock);
+	ret = __krdma_init_cb(cb);
+	mutex_unlock(&cb->rlock);
+	return ret;
+}
+
+static void krdma_pack_rw_priv(struct krdma_cb *cb, krdma_rw_priv_t *priv,
+		bool ext);
+static int krdma_unpack_rw_priv(struct krdma_cb *cb);
+static int krdma_exch_info_client(struct krdma_cb *cb);
+static int krdma_exch_info_server(struct krdma_cb *cb);
+
 static int __krdma_connect(struct krdma_cb *cb) {
 	int ret;
 	struct rdma_conn_param conn_param;
+	krdma_rw_priv_t priv;
 
 	/* Connect to remote. */
 	memset(&conn_param, 0, sizeof(conn_param));
@@ -811,6 +1303,12 @@ static int __krdma_connect(struct krdma_cb *cb) {
 	 */
 	conn_param.rnr_retry_count = 7;
 
+	if (cb->read_write) {
+		krdma_pack_rw_priv(cb, &priv, false);
+		conn_param.private_data = &priv;
+		conn_param.private_data_len = sizeof(priv);
+	}
+
 	ret = rdma_connect(cb->cm_id, &conn_param);
 	if (ret) {
 		krdma_err("rdma_connect failed, ret %d\n", ret);
@@ -827,13 +1325,24 @@ static int __krdma_connect(struct krdma_cb *cb) {
 		return ret;
 	}
 	krdma_debug("krdma_connect_single succeed, cm_id %p\n", cb->cm_id);
+
+	if (cb->read_write) {
+		/* The server flags the reply if the descriptors did not fit. */
+		ret = krdma_unpack_rw_priv(cb);
+		if (ret == -EAGAIN)
+			ret = krdma_exch_info_client(cb);
+		if (ret < 0) {
+			krdma_err("exchange rw info failed, ret %d\n", ret);
+			return -CLIENT_EXIT;
+		}
+	}
 	return 0;
 }
 
 static int __krdma_listen(struct krdma_cb *cb) {
 	int ret;
 
-	ret = rdma_listen(cb->cm_id, 3);
+	ret = rdma_listen(cb->cm_id, cb->backlog);
 	if (ret) {
 		krdma_err("rdma_listen failed: %d\n", ret);
 		return ret;
@@ -845,11 +1354,24 @@ static int __krdma_listen(struct krdma_cb *cb) {
 static int __krdma_accept(struct krdma_cb *cb) {
 	int ret;
 	struct rdma_conn_param conn_param;
+	krdma_rw_priv_t priv;
+	bool exch_info = false;
 
 	/* Accept */
 	memset(&conn_param, 0, sizeof conn_param);
 	conn_param.retry_count = conn_param.rnr_retry_count = 7;
 
+	if (cb->read_write) {
+		ret = krdma_unpack_rw_priv(cb);
+		if (ret < 0 && ret != -EAGAIN)
+			goto exit;
+		exch_info = ret == -EAGAIN;
+		/* Tell the client to fall back as well. */
+		krdma_pack_rw_priv(cb, &priv, exch_info);
+		conn_param.private_data = &priv;
+		conn_param.private_data_len = sizeof(priv);
+	}
+
 	ret = rdma_accept(cb->cm_id, &conn_param);
 	if (ret) {
 		krdma_err("rdma_accept error: %d\n", ret);
@@ -858,9 +1380,16 @@ static int __krdma_accept(struct krdma_cb *cb) {
 	wait_for_completion(&cb->cm_done);
 	if (cb->state != KRDMA_CONNECTED) {
 		krdma_err("wait for KRDMA_CONNECTED state, but get %d\n", cb->state);
+		ret = -STATE_ERROR;
 		goto exit;
 	}
 
+	if (exch_info) {
+		ret = krdma_exch_info_server(cb);
+		if (ret < 0)
+			goto exit;
+	}
+
 	krdma_debug("new connection accepted with the following attributes:\n"
 		"local: %pI4:%d\nremote: %pI4:%d\n",
 		&((struct sockaddr_in *)&cb->cm_id->route.addr.src_addr)->sin_addr.s_addr,
@@ -872,6 +1401,158 @@ exit:
 	return ret;
 }
 
+////////////////////////////////////////////////////////////////////
+//////////////////////Connection Pool///////////////////////////////
+////////////////////////////////////////////////////////////////////
+
+struct krdma_conn_entry {
+	struct hlist_node hnode;
+	char host[INET_ADDRSTRLEN];
+	char port[8];
+	bool read_write;
+
+	/* Serializes establishing the connection. */
+	struct mutex lock;
+	struct krdma_cb *cb;
+	/* Protected by krdma_conn_pool_lock. */
+	int refcnt;
+};
+
+static DEFINE_HASHTABLE(krdma_conn_pool, KRDMA_CONN_POOL_BITS);
+static DEFINE_MUTEX(krdma_conn_pool_lock);
+
+static u32 krdma_conn_hash(const char *host, const char *port, bool read_write)
+{
+	return jhash(host, strlen(host), jhash(port, strlen(port), read_write));
+}
+
+static bool krdma_cb_broken(struct krdma_cb *cb)
+{
+	return cb->state == KRDMA_ERROR || cb->state == KRDMA_DISCONNECTED ||
+		cb->state == KRDMA_CONNECT_REJECTED;
+}
+
+static void krdma_conn_entry_release(struct krdma_conn_entry *entry)
+{
+	if (!entry->cb)
+		return;
+	krdma_release_cb(entry->cb);
+	__krdma_free_cb(entry->cb);
+	entry->cb = NULL;
+}
+
+/* Called with krdma_conn_pool_lock held. */
+static struct krdma_conn_entry *krdma_conn_lookup(const char *host,
+		const char *port, bool read_write)
+{
+	struct krdma_conn_entry *entry;
+	u32 key = krdma_conn_hash(host, port, read_write);
+
+	hash_for_each_possible(krdma_conn_pool, entry, hnode, key) {
+		if (entry->read_write == read_write &&
+				!strcmp(entry->host, host) && !strcmp(entry->port, port))
+			return entry;
+	}
+
+	entry = kzalloc(sizeof(*entry), GFP_KERNEL);
+	if (!entry)
+		return NULL;
+	strscpy(entry->host, host, sizeof(entry->host));
+	strscpy(entry->port, port, sizeof(entry->port));
+	entry->read_write = read_write;
+	mutex_init(&entry->lock);
+	hash_add(krdma_conn_pool, &entry->hnode, key);
+	return entry;
+}
+
+int krdma_conn_get(const char *host, const char *port, bool read_write,
+		struct krdma_cb **conn_cb)
+{
+	int ret = 0;
+	bool sole;
+	struct krdma_cb *cb;
+	struct krdma_conn_entry *entry;
+
+	if (host == NULL || port == NULL || conn_cb == NULL)
+		return -EINVAL;
+
+	mutex_lock(&krdma_conn_pool_lock);
+	entry = krdma_conn_lookup(host, port, read_write);
+	if (!entry) {
+		mutex_unlock(&krdma_conn_pool_lock);
+		return -ENOMEM;
+	}
+	sole = ++entry->refcnt == 1;
+	mutex_unlock(&krdma_conn_pool_lock);
+
+	mutex_lock(&entry->lock);
+	/* Nobody else can be using a broken cb, reconnect it. */
+	if (entry->cb && sole && krdma_cb_broken(entry->cb)) {
+		krdma_debug("pool cb %p to %s:%s broken, reconnecting\n",
+				entry->cb, host, port);
+		krdma_conn_entry_release(entry);
+	}
+	if (!entry->cb) {
+		ret = read_write ? krdma_rw_init_client(host, port, &cb) :
+			krdma_connect(host, port, &cb);
+		if (ret == 0) {
+			cb->conn_entry = entry;
+			entry->cb = cb;
+		}
+	}
+	cb = entry->cb;
+	mutex_unlock(&entry->lock);
+
+	if (ret < 0) {
+		mutex_lock(&krdma_conn_pool_lock);
+		/* The last user of an entry that never connected frees it. */
+		if (--entry->refcnt == 0 && !entry->cb) {
+			hash_del(&entry->hnode);
+			kfree(entry);
+		}
+		mutex_unlock(&krdma_conn_pool_lock);
+		*conn_cb = NULL;
+		return ret;
+	}
+	*conn_cb = cb;
+	return 0;
+}
+EXPORT_SYMBOL_GPL(krdma_conn_get);
+
+void krdma_conn_put(struct krdma_cb *cb)
+{
+	struct krdma_conn_entry *entry;
+
+	if (cb == NULL || (entry = cb->conn_entry) == NULL)
+		return;
+
+	mutex_lock(&krdma_conn_pool_lock);
+	BUG_ON(entry->refcnt <= 0);
+	/* Keep the connection warm for the next user. */
+	entry->refcnt--;
+	mutex_unlock(&krdma_conn_pool_lock);
+}
+EXPORT_SYMBOL_GPL(krdma_conn_put);
+
+void krdma_conn_pool_destroy(void)
+{
+	int bkt;
+	struct hlist_node *tmp;
+	struct krdma_conn_entry *entry;
+
+	mutex_lock(&krdma_conn_pool_lock);
+	hash_for_each_safe(krdma_conn_pool, bkt, tmp, entry, hnode) {
+		if (entry->refcnt)
+			krdma_err("pool cb to %s:%s still has %d users\n",
+					entry->host, entry->port, entry->refcnt);
+		hash_del(&entry->hnode);
+		krdma_conn_entry_release(entry);
+		kfree(entry);
+	}
+	mutex_unlock(&krdma_conn_pool_lock);
+}
+EXPORT_SYMBOL_GPL(krdma_conn_pool_destroy);
+
 ////////////////////////////////////////////////////////////////////
 //////////////////////SEND/RECV Functions///////////////////////////
 ////////////////////////////////////////////////////////////////////
@@ -898,6 +1579,11 @@ static int krdma_poll(struct krdma_cb *cb, imm_t *imm, size_t *length,
 	case KRDMA_RECV:
 		cq = cb->recv_cq;
 		break;
+	case KRDMA_READ:
+	case KRDMA_WRITE:
+		/* One-sided operations complete on the send cq. */
+		cq = cb->send_cq;
+		break;
 	default:
 		return -EINVAL;
 	}
@@ -1107,18 +1793,25 @@ static void build_krdma_send_output(const struct krdma_cb *cb,
  * |<------------------------sz=wc.byte_len------------------------------->|
  * |<----real data (sz=ret_val of send/recv)--->|<---2nd part of tx_add--->|
  */
-/* rdma transaction->krdma interfaces. */
-static size_t build_krdma_recv_output(struct krdma_cb *cb,
-		krdma_recv_trans_t *trans, char *buffer, tx_add_t *tx_add)
+/*
+ * rdma transaction->krdma interfaces.
+ * A message larger than len is dropped, and -EMSGSIZE returned.
+ */
+static int build_krdma_recv_output(struct krdma_cb *cb,
+		krdma_recv_trans_t *trans, char *buffer, size_t len, tx_add_t *tx_add)
 {
 	size_t real_length = trans->length - (sizeof(tx_add_t) - sizeof(imm_t));
 
 	memcpy(tx_add, &trans->imm, sizeof(imm_t));
 	memcpy(((char *)tx_add) + sizeof(imm_t), trans->recv_buf + real_length,
 			sizeof(tx_add_t) - sizeof(imm_t));
-	memcpy(buffer, trans->recv_buf, real_length);
-
 	trans->state = INVALID;
+	if (real_length > len) {
+		krdma_err("%s: cb %p message %lu larger than buffer %lu\n", __func__,
+				cb, real_length, len);
+		return -EMSGSIZE;
+	}
+	memcpy(buffer, trans->recv_buf, real_length);
 
 	return real_length;
 }
@@ -1148,7 +1841,9 @@ static int krdma_post_recv(struct krdma_cb *cb)
  * acceptance all receiving requests.
  * wr_id means which slot is used for transmission.
  */
-int krdma_receive(struct krdma_cb *cb, char *buffer)
+/* @param gen set to the generation of the connection polled last. */
+static int __krdma_receive(struct krdma_cb *cb, char *buffer, size_t length,
+		int *gen)
 {
 	int ret;
 	size_t len;
@@ -1171,11 +1866,12 @@ int krdma_receive(struct krdma_cb *cb, char *buffer)
 	krdma_debug("%s: cb %p receive 0x%x\n", __func__, cb, tx_add.txid);
 
 	mutex_lock(&cb->rlock);
+	*gen = atomic_read(&cb->conn_gen);
 
 repoll:
 	/* Search in the buffer. */
 	if (search_recv_buf(cb, txid, &recv_trans, POLLED)) {
-		ret = build_krdma_recv_output(cb, recv_trans, buffer, &tx_add);
+		ret = build_krdma_recv_output(cb, recv_trans, buffer, length, &tx_add);
 		mutex_unlock(&cb->rlock);
 		krdma_debug("%s: cb %p find 0x%x in buffer\n", __func__, cb, tx_add.txid);
 
@@ -1199,6 +1895,7 @@ repoll:
 				return -EAGAIN;
 			}
 			mutex_lock(&cb->rlock);
+			*gen = atomic_read(&cb->conn_gen);
 			goto repoll;
 		}
 		mutex_unlock(&cb->rlock);
@@ -1222,17 +1919,19 @@ repoll:
 	}
 	else {
 		/* My transaction ! */
-		build_krdma_recv_output(cb, recv_trans, buffer, &tx_add);
+		ret = build_krdma_recv_output(cb, recv_trans, buffer, length, &tx_add);
 		krdma_debug("%s: cb %p find my tx 0x%x\n", __func__, cb, tx_add.txid);
 	}
 
 	mutex_unlock(&cb->rlock);
 	krdma_debug("%s: cb %p received 0x%x\n", __func__, cb, txid);
-	return ret >= 0 ? len - (sizeof(tx_add_t) - sizeof(imm_t)) : ret;
+	return ret;
 }
 
 /* wr_id of send means txid. */
-int krdma_send(struct krdma_cb *cb, const char *buffer, size_t length)
+/* @param gen set to the generation of the connection the send is posted on. */
+static int __krdma_send(struct krdma_cb *cb, const char *buffer, size_t length,
+		int *gen)
 {
 	int ret = 0;
 	struct ib_send_wr *bad_wr;
@@ -1248,6 +1947,7 @@ int krdma_send(struct krdma_cb *cb, const char *buffer, size_t length)
 
 	BUG_ON(cb->read_write);
 	mutex_lock(&cb->slock);
+	*gen = atomic_read(&cb->conn_gen);
 
 	slot = search_empty_send_buf(cb, &send_trans);
 	build_posted_send_trans(cb, txid, send_trans);
@@ -1301,6 +2001,32 @@ int krdma_send(struct krdma_cb *cb, const char *buffer, size_t length)
 	return ret >= 0 ? length : ret;
 }
 
+int krdma_receive(struct krdma_cb *cb, char *buffer, size_t length)
+{
+	int ret, gen, replay = 0;
+
+	while ((ret = __krdma_receive(cb, buffer, length, &gen)) < 0 &&
+			replay++ < KRDMA_REPLAY_MAX) {
+		if (krdma_wait_reconnect(cb, ret, gen))
+			break;
+	}
+	return ret;
+}
+EXPORT_SYMBOL_GPL(krdma_receive);
+
+int krdma_send(struct krdma_cb *cb, const char *buffer, size_t length)
+{
+	int ret, gen, replay = 0;
+
+	while ((ret = __krdma_send(cb, buffer, length, &gen)) < 0 &&
+			replay++ < KRDMA_REPLAY_MAX) {
+		if (krdma_wait_reconnect(cb, ret, gen))
+			break;
+	}
+	return ret;
+}
+EXPORT_SYMBOL_GPL(krdma_send);
+
 ////////////////////////////////////////////////////////////////////
 //////////////////RDMA READ/WRITE Functions/////////////////////////
 ////////////////////////////////////////////////////////////////////
@@ -1314,6 +2040,60 @@ static void dump_rw_info(krdma_rw_info_t *info, char *desc) {
 		desc, info->addr, info->rkey, info->qp_num, info->lid);
 }
 
+static void krdma_pack_rw_priv(struct krdma_cb *cb, krdma_rw_priv_t *priv,
+		bool ext)
+{
+	krdma_rw_info_t *local_info = cb->mr.rw_mr.local_info;
+
+	BUILD_BUG_ON(sizeof(krdma_rw_priv_t) > KRDMA_PRIV_DATA_MAX);
+
+	memset(priv, 0, sizeof(*priv));
+	priv->version = KRDMA_PRIV_VERSION;
+	if (ext) {
+		priv->flags = KRDMA_PRIV_EXT;
+		return;
+	}
+	priv->lid = local_info->lid;
+	priv->rkey = local_info->rkey;
+	priv->qp_num = local_info->qp_num;
+	priv->addr = local_info->addr;
+	priv->length = local_info->length;
+}
+
+/*
+ * Fill remote_info from the private data saved by the cm event handler.
+ * @return -EAGAIN if the descriptor has to be exchanged over ktcp.
+ */
+static int krdma_unpack_rw_priv(struct krdma_cb *cb)
+{
+	krdma_rw_priv_t priv;
+	krdma_rw_info_t *remote_info = cb->mr.rw_mr.remote_info;
+
+	if (!remote_info) {
+		krdma_err("NULL info!\n");
+		return -EINVAL;
+	}
+
+	/* Peers that do not know about private data send none. */
+	if (cb->peer_priv_len < sizeof(priv))
+		return -EAGAIN;
+	memcpy(&priv, cb->peer_priv, sizeof(priv));
+	if (priv.version != KRDMA_PRIV_VERSION || (priv.flags & KRDMA_PRIV_EXT))
+		return -EAGAIN;
+
+	remote_info->buf = NULL;
+	remote_info->lid = priv.lid;
+	remote_info->rkey = priv.rkey;
+	remote_info->qp_num = priv.qp_num;
+	remote_info->addr = priv.addr;
+	remote_info->length = priv.length;
+
+	dump_rw_info(cb->mr.rw_mr.local_info, "local_info");
+	dump_rw_info(remote_info, "remote_info");
+	return 0;
+}
+
+/* Side channel, only used when the descriptors do not fit in private data. */
 static const char *server_host = "10.0.16.6";
 static const char *server_port = "22421";
 
@@ -1341,7 +2121,8 @@ static int krdma_exch_info_client(struct krdma_cb *cb) {
 		goto out_release_tcp;
 	}
 
-	ret = ktcp_receive(conn_tcp, (char *) remote_info);
+	ret = ktcp_receive(conn_tcp, (char *) remote_info,
+			sizeof(krdma_rw_info_t));
 	if (ret < 0 || ret < sizeof(krdma_rw_info_t)) {
 		krdma_err("ktcp_receive failed with ret %d.\n", ret);
 		goto out_release_tcp;
@@ -1352,7 +2133,9 @@ static int krdma_exch_info_client(struct krdma_cb *cb) {
 
 out_release_tcp:
 	ktcp_release(conn_tcp);
-	return ret > 0 ? -ret : ret;
+	if (ret >= 0 && ret < sizeof(krdma_rw_info_t))
+		ret = -EIO;
+	return ret < 0 ? ret : 0;
 }
 
 static int krdma_exch_info_server(struct krdma_cb *cb) {
@@ -1379,7 +2162,8 @@ static int krdma_exch_info_server(struct krdma_cb *cb) {
 		goto out_release_listen_tcp;
 	}
 
-	ret = ktcp_receive(accept_tcp, (char *) remote_info);
+	ret = ktcp_receive(accept_tcp, (char *) remote_info,
+			sizeof(krdma_rw_info_t));
 	if (ret < 0 || ret < sizeof(krdma_rw_info_t)) {
 		krdma_err("ktcp_receive failed with ret %d.\n", ret);
 		goto out_release_accept_tcp;
@@ -1400,7 +2184,9 @@ out_release_accept_tcp:
 out_release_listen_tcp:
 	ktcp_release(listen_tcp);
 exit:
-	return ret > 0 ? -ret : ret;
+	if (ret >= 0 && ret < sizeof(krdma_rw_info_t))
+		ret = -EIO;
+	return ret < 0 ? ret : 0;
 }
 
 int krdma_rw_init_client(const char *host, const char *port, struct krdma_cb **conn_cb) {
@@ -1428,33 +2214,23 @@ retry:
 		 */
 		smp_mb();
 		*conn_cb = cb;
-		goto rest_client_init;
+		/* remote_info has been filled in by __krdma_connect. */
+		return 0;
 	}
 	if (ret == -CLIENT_RETRY &&
 				++cb->retry_count < RDMA_CONNECT_RETRY_MAX) {
 		krdma_err("krdma_connect_single failed, retry_count %d, " \
 				"reconnecting...\n", cb->retry_count);
-		msleep(1000);
+		msleep(RDMA_CONNECT_RETRY_DELAY);
 		goto retry;
 	}
-	goto out_free_cb;
-
-
-rest_client_init:
-	ret = krdma_exch_info_client(cb);
-	if (ret < 0) {
-		krdma_err("krdma_exch_info_client failed with ret %d\n", ret);
-		goto out_release_cb;
-	}
 
-out_release_cb:
-	krdma_release_cb(cb);
-out_free_cb:
 	__krdma_free_cb(cb);
 	*conn_cb = NULL;
 	krdma_err("krdma_rw_init_client failed, ret: %d\n", ret);
 	return ret;
 }
+EXPORT_SYMBOL_GPL(krdma_rw_init_client);
 
 int krdma_rw_init_server(const char *host, const char *port, struct krdma_cb **cbp) {
 	int ret;
@@ -1483,14 +2259,11 @@ int krdma_rw_init_server(const char *host, const char *port, struct krdma_cb **c
 	if (ret < 0)
 		goto out_free_accept_cb;
 
+	/* Also exchanges local_info/remote_info with the client. */
 	ret = __krdma_accept(accept_cb);
 	if (ret < 0)
 		goto out_release_accept_cb;
-	
-	ret = krdma_exch_info_server(accept_cb);
-	if (ret < 0)
-		goto out_release_accept_cb;
-	
+
 	return 0;
 
 out_release_accept_cb:
@@ -1506,6 +2279,7 @@ out_release_listen_cb:
 exit:
 	return ret;
 }
+EXPORT_SYMBOL_GPL(krdma_rw_init_server);
 
 static void build_krdma_read_output(
 	struct krdma_cb *cb, char *buffer, size_t length) {
@@ -1523,7 +2297,7 @@ static void build_krdma_write_input(
 	memcpy(cb->mr.rw_mr.local_info->buf, buffer, length);
 }
 
-int krdma_read(struct krdma_cb *cb, char *buffer, size_t length) {
+static int __krdma_read(struct krdma_cb *cb, char *buffer, size_t length) {
 	struct ib_rdma_wr rdma_wr;
 	struct ib_send_wr *bad_wr = NULL;
 	struct ib_sge sge[1];
@@ -1564,13 +2338,21 @@ int krdma_read(struct krdma_cb *cb, char *buffer, size_t length) {
 	}
 	krdma_debug("krdma_poll succeed.\n");
 
+	/* The whole remote buffer has just been fetched into local buf. */
+	if (cb->mr.rw_mr.twin) {
+		memcpy(cb->mr.rw_mr.twin, cb->mr.rw_mr.local_info->buf,
+				cb->mr.rw_mr.local_info->length);
+		cb->mr.rw_mr.twin_valid = true;
+	}
+
 	build_krdma_read_output(cb, buffer, length);
 	krdma_debug("krdma_read succeed with buffer = %s, length = %lu.\n", 
 		buffer, length);
 	return 0;
 }
 
-int krdma_write(struct krdma_cb *cb, const char *buffer, size_t length) {
+static int __krdma_write_full(struct krdma_cb *cb, const char *buffer,
+		size_t length) {
 	struct ib_rdma_wr rdma_wr;
 	struct ib_send_wr *bad_wr = NULL;
 	struct ib_sge sge[1];
@@ -1614,11 +2396,206 @@ int krdma_write(struct krdma_cb *cb, const char *buffer, size_t length) {
 	}
 	krdma_debug("krdma_poll succeed.\n");
 
+	if (cb->mr.rw_mr.twin) {
+		memcpy(cb->mr.rw_mr.twin, cb->mr.rw_mr.local_info->buf,
+				cb->mr.rw_mr.local_info->length);
+		cb->mr.rw_mr.twin_valid = true;
+	}
+
 	krdma_debug("krdma_write succeed with buffer = %s, length = %lu.\n", 
 		buffer, length);
 	return 0;
 }
 
+/*
+ * Compare one cacheline word by word. XOR-ing and OR-ing whole words without
+ * an early exit lets the compiler unroll the loop, and keeps us off the FPU
+ * which kernel code cannot use without kernel_fpu_begin().
+ */
+static inline bool krdma_line_dirty(const char *a, const char *b, size_t len)
+{
+	const unsigned long *wa = (const unsigned long *) a;
+	const unsigned long *wb = (const unsigned long *) b;
+	unsigned long diff = 0;
+	int i;
+
+	if (len != KRDMA_DELTA_LINE ||
+			!IS_ALIGNED((unsigned long) a, sizeof(unsigned long)))
+		return memcmp(a, b, len) != 0;
+
+	for (i = 0; i < KRDMA_DELTA_LINE / sizeof(unsigned long); i++)
+		diff |= wa[i] ^ wb[i];
+	return diff != 0;
+}
+
+/*
+ * Collect the dirty cachelines of buffer as runs. When we run out of runs,
+ * the last one is stretched over the clean gap instead.
+ * @return the number of runs.
+ */
+static int krdma_delta_runs(const char *buffer, const char *twin, size_t length,
+		struct krdma_delta_run *runs, int max_runs)
+{
+	size_t off, len;
+	int nr = 0;
+
+	for (off = 0; off < length; off += KRDMA_DELTA_LINE) {
+		len = min_t(size_t, KRDMA_DELTA_LINE, length - off);
+		if (!krdma_line_dirty(buffer + off, twin + off, len))
+			continue;
+
+		if (nr > 0 && (runs[nr - 1].offset + runs[nr - 1].length == off ||
+					nr == max_runs)) {
+			runs[nr - 1].length = off + len - runs[nr - 1].offset;
+			continue;
+		}
+		runs[nr].offset = off;
+		runs[nr].length = len;
+		nr++;
+	}
+	return nr;
+}
+
+static int __krdma_write_delta(struct krdma_cb *cb, const char *buffer,
+		size_t length) {
+	struct ib_rdma_wr *rdma_wr = cb->mr.rw_mr.delta_wrs->rdma_wr;
+	struct ib_sge *sge = cb->mr.rw_mr.delta_wrs->sge;
+	struct krdma_delta_run *runs = cb->mr.rw_mr.delta_wrs->runs;
+	struct ib_send_wr *bad_wr = NULL;
+	krdma_rw_info_t *local_info = cb->mr.rw_mr.local_info;
+	krdma_rw_info_t *remote_info = cb->mr.rw_mr.remote_info;
+	char *twin = cb->mr.rw_mr.twin;
+	int i, nr, ret;
+	imm_t imm = 666;
+	size_t len;
+
+	/* Nothing known about the remote content yet, ship everything once. */
+	if (!cb->mr.rw_mr.twin_valid)
+		return __krdma_write_full(cb, buffer, length);
+
+	nr = krdma_delta_runs(buffer, twin, length, runs, RDMA_RW_QUEUE_DEPTH);
+
+	memset(sge, 0, sizeof(sge[0]) * max(nr, 1));
+	memset(rdma_wr, 0, sizeof(rdma_wr[0]) * max(nr, 1));
+
+	for (i = 0; i < nr; i++) {
+		memcpy(local_info->buf + runs[i].offset, buffer + runs[i].offset,
+				runs[i].length);
+		memcpy(twin + runs[i].offset, buffer + runs[i].offset, runs[i].length);
+
+		sge[i].addr = local_info->addr + runs[i].offset;
+		sge[i].length = runs[i].length;
+		sge[i].lkey = cb->pd->local_dma_lkey;
+
+		rdma_wr[i].remote_addr = remote_info->addr + runs[i].offset;
+		rdma_wr[i].rkey = remote_info->rkey;
+
+		rdma_wr[i].wr.sg_list = &sge[i];
+		rdma_wr[i].wr.wr_id = 999;
+		rdma_wr[i].wr.opcode = IB_WR_RDMA_WRITE;
+		rdma_wr[i].wr.num_sge = 1;
+		rdma_wr[i].wr.next = i + 1 < nr ? &rdma_wr[i + 1].wr : NULL;
+	}
+	/* Nothing changed, a write of nothing still carries the immediate. */
+	if (nr == 0) {
+		rdma_wr[0].remote_addr = remote_info->addr;
+		rdma_wr[0].rkey = remote_info->rkey;
+		rdma_wr[0].wr.wr_id = 999;
+		nr = 1;
+	}
+	/*
+	 * RC completes in order, so waiting for the last one is enough. It also
+	 * carries the immediate, so that the peer is told of a delta write the
+	 * same way as of a full one.
+	 */
+	rdma_wr[nr - 1].wr.opcode = IB_WR_RDMA_WRITE_WITH_IMM;
+	rdma_wr[nr - 1].wr.ex.imm_data = imm;
+	rdma_wr[nr - 1].wr.send_flags = IB_SEND_SIGNALED;
+
+	ret = ib_post_send(cb->qp, &rdma_wr[0].wr, &bad_wr);
+	if (unlikely(ret)) {
+		krdma_err("ib_post_send failed.\n");
+		cb->mr.rw_mr.twin_valid = false;
+		return ret;
+	}
+
+	ret = krdma_poll(cb, &imm, &len, true, KRDMA_WRITE);
+	if (unlikely(ret < 0)) {
+		krdma_err("krdma_poll failed with ret %d.\n", ret);
+		cb->mr.rw_mr.twin_valid = false;
+		return ret;
+	}
+
+	krdma_debug("krdma_write delta %d runs, length = %lu.\n", nr, length);
+	return 0;
+}
+
+int krdma_read(struct krdma_cb *cb, char *buffer, size_t length) {
+	int ret, gen, replay = 0;
+
+	BUG_ON(!cb->read_write);
+
+	do {
+		mutex_lock(&cb->slock);
+		gen = atomic_read(&cb->conn_gen);
+		ret = __krdma_read(cb, buffer, length);
+		mutex_unlock(&cb->slock);
+	} while (ret < 0 && replay++ < KRDMA_REPLAY_MAX &&
+			krdma_wait_reconnect(cb, ret, gen) == 0);
+	return ret;
+}
+EXPORT_SYMBOL_GPL(krdma_read);
+
+int krdma_write(struct krdma_cb *cb, const char *buffer, size_t length) {
+	int ret, gen, replay = 0;
+
+	BUG_ON(!cb->read_write);
+
+	if (length > cb->mr.rw_mr.local_info->length)
+		return -EINVAL;
+
+	do {
+		mutex_lock(&cb->slock);
+		gen = atomic_read(&cb->conn_gen);
+		ret = cb->mr.rw_mr.twin ? __krdma_write_delta(cb, buffer, length) :
+			__krdma_write_full(cb, buffer, length);
+		mutex_unlock(&cb->slock);
+	} while (ret < 0 && replay++ < KRDMA_REPLAY_MAX &&
+			krdma_wait_reconnect(cb, ret, gen) == 0);
+	return ret;
+}
+EXPORT_SYMBOL_GPL(krdma_write);
+
+static int __krdma_rw_alloc_twin(struct krdma_cb *cb) {
+	cb->mr.rw_mr.twin = vmalloc(cb->mr.rw_mr.local_info->length);
+	cb->mr.rw_mr.delta_wrs = kmalloc(sizeof(struct krdma_delta_wrs),
+			GFP_KERNEL);
+	if (!cb->mr.rw_mr.twin || !cb->mr.rw_mr.delta_wrs) {
+		__krdma_rw_free_twin(cb);
+		return -ENOMEM;
+	}
+	/* Filled by the next full read or write. */
+	cb->mr.rw_mr.twin_valid = false;
+	return 0;
+}
+
+int krdma_rw_set_delta(struct krdma_cb *cb, bool enable) {
+	int ret = 0;
+
+	if (cb == NULL || !cb->read_write)
+		return -EINVAL;
+
+	mutex_lock(&cb->slock);
+	if (enable && !cb->mr.rw_mr.twin) {
+		ret = __krdma_rw_alloc_twin(cb);
+	} else if (!enable && cb->mr.rw_mr.twin) {
+		__krdma_rw_free_twin(cb);
+	}
+	mutex_unlock(&cb->slock);
+	return ret;
+}
+EXPORT_SYMBOL_GPL(krdma_rw_set_delta);
+
 
 static int sr_client(void *data) {
 	struct krdma_cb *cb = NULL;
@@ -1667,7 +2644,7 @@ static int sr_server(void *data) {
 			goto free_listen_cb;
 		}
 		krdma_debug("krdma_accept succeed.\n");
-		ret = krdma_receive(accept_cb, (char *) &buf);
+		ret = krdma_receive(accept_cb, (char *) &buf, sizeof(buf));
 		if (ret < 0) {
 			krdma_err("krdma_receive failed.\n");
 			goto free_accept_cb;
@@ -1676,8 +2653,7 @@ static int sr_server(void *data) {
 	}
 
 free_accept_cb:
-	krdma_release_cb(accept_cb);
-	__krdma_free_cb(accept_cb);
+	krdma_free_cb(accept_cb);
 free_listen_cb:
 	krdma_release_cb(listen_cb);
 	__krdma_free_cb(listen_cb);
@@ -1699,6 +2675,31 @@ static int rw_server(void *data) {
 	return ret;
 }
 
+/* Failed connects through the pool must not leave entries behind. */
+static int pool_test(void) {
+	struct krdma_cb *cb = NULL;
+	bool empty;
+	int i, ret;
+
+	for (i = 0; i < 4; i++) {
+		ret = krdma_conn_get("172.16.0.2", "1", false, &cb);
+		if (ret == 0) {
+			krdma_err("pool_test: connected to a closed port.\n");
+			krdma_conn_put(cb);
+			return -EINVAL;
+		}
+	}
+	mutex_lock(&krdma_conn_pool_lock);
+	empty = hash_empty(krdma_conn_pool);
+	mutex_unlock(&krdma_conn_pool_lock);
+	if (!empty) {
+		krdma_err("pool_test: failed connects left entries in the pool.\n");
+		return -EINVAL;
+	}
+	krdma_debug("pool_test succeed.\n");
+	return 0;
+}
+
 static struct task_struct *thread = NULL;
 
 static int server = 1; // server or client?
@@ -1707,6 +2708,9 @@ module_param(server, int, S_IRUGO);
 static int rw = 1; // read/write or send/recv?
 module_param(rw, int, S_IRUGO);
 
+static int test_pool = 0; // run pool_test() at load?
+module_param(test_pool, int, S_IRUGO);
+
 int __init krdma_init(void) {
 	int ret;
 	int (*func[4])(void *data) = {
@@ -1720,6 +2724,12 @@ int __init krdma_init(void) {
 	krdma_err("server %d\n", server);
 	krdma_err("read/write %d\n", rw);
 
+	if (test_pool) {
+		ret = pool_test();
+		if (ret < 0)
+			return ret;
+	}
+
 	thread = kthread_run(func[choice], NULL, name[choice]);
 	if (IS_ERR(thread)) {
 		krdma_err("%s start failed.\n", name[choice]);
@@ -1736,6 +2746,7 @@ void __exit krdma_exit(void) {
 	if (ret < 0) {
 		krdma_err("kill thread failed.\n");
 	}
+	krdma_conn_pool_destroy();
 }
 
 module_init(krdma_init);
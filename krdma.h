@@ -12,6 +12,7 @@
  */
 #include <linux/pci.h>
 #include <linux/list.h>
+#include <linux/workqueue.h>
 
 #include <rdma/ib_verbs.h>
 #include <rdma/rdma_cm.h>
@@ -20,6 +21,8 @@
 
 #define RDMA_RESOLVE_TIMEOUT 2000
 #define RDMA_CONNECT_RETRY_MAX 3
+/* In ms */
+#define RDMA_CONNECT_RETRY_DELAY 1000
 
 #define RDMA_SEND_QUEUE_DEPTH 1
 #define RDMA_RECV_QUEUE_DEPTH 32
@@ -28,12 +31,45 @@
 #define RDMA_SEND_BUF_SIZE RDMA_SEND_QUEUE_DEPTH
 #define RDMA_RECV_BUF_SIZE RDMA_RECV_QUEUE_DEPTH
 
+/* Read/write cbs chain up to this many RDMA writes per delta write-back. */
+#define RDMA_RW_QUEUE_DEPTH 16
+
 #define RDMA_SEND_BUF_LEN (PAGE_SIZE * 1024)
 #define RDMA_RECV_BUF_LEN (PAGE_SIZE * 1024)
 #define RDMA_RDWR_BUF_LEN (PAGE_SIZE * 1024)
 
+/* Granularity at which delta write-back compares against the twin. */
+#define KRDMA_DELTA_LINE L1_CACHE_BYTES
+
+/* Resilient cbs: how long callers wait for a reconnection, in ms */
+#define KRDMA_RECONNECT_TIMEOUT 5000
+#define KRDMA_RECONNECT_RETRY_MAX 8
+/* Worst case of one attempt: address and route resolution */
+#define KRDMA_RECONNECT_ATTEMPT (2 * RDMA_RESOLVE_TIMEOUT)
+/* How many times a request is replayed after reconnections */
+#define KRDMA_REPLAY_MAX 2
+
+/* Pending connect requests rdma_listen() queues by default. */
+#define RDMA_LISTEN_BACKLOG 128
+#define RDMA_ACCEPT_WORKERS 4
+
+/* Number of hash buckets of the connection pool, in bits. */
+#define KRDMA_CONN_POOL_BITS 6
+
 typedef uint32_t imm_t;
 
+struct krdma_delta_run {
+	size_t offset;
+	size_t length;
+};
+
+/* Work requests of one delta write-back, kept with the twin off the stack. */
+struct krdma_delta_wrs {
+	struct ib_rdma_wr rdma_wr[RDMA_RW_QUEUE_DEPTH];
+	struct ib_sge sge[RDMA_RW_QUEUE_DEPTH];
+	struct krdma_delta_run runs[RDMA_RW_QUEUE_DEPTH];
+};
+
 
 enum krdma_role {
 	KRDMA_CLIENT_CONN = 0,
@@ -71,6 +107,26 @@ typedef struct krdma_rw_info {
 	uint16_t lid;
 } __attribute__((packed)) krdma_rw_info_t;
 
+/*
+ * The part of krdma_rw_info_t the peer needs, carried in the private data of
+ * the rdma_cm REQ/REP. 56 bytes is the smallest private data limit among the
+ * transports we run on (IB CM REQ with RDMA_PS_TCP).
+ */
+#define KRDMA_PRIV_DATA_MAX 56
+#define KRDMA_PRIV_VERSION 1
+/* The descriptor does not fit, exchange krdma_rw_info_t over ktcp instead. */
+#define KRDMA_PRIV_EXT 0x1
+
+typedef struct krdma_rw_priv {
+	uint8_t version;
+	uint8_t flags;
+	uint16_t lid;
+	uint32_t rkey;
+	uint32_t qp_num;
+	uint64_t addr;
+	uint64_t length;
+} __attribute__((packed)) krdma_rw_priv_t;
+
 typedef struct krdma_send_trans {
 	/* For DMA */
 	void *send_buf;
@@ -95,6 +151,9 @@ typedef struct krdma_recv_trans {
 	struct ib_recv_wr rq_wr;
 } krdma_recv_trans_t;
 
+struct krdma_conn_entry;
+struct krdma_accept_engine;
+
 /* control block that supports both RDMA send/recv and read/write */
 struct krdma_cb {
 	struct mutex slock;
@@ -141,17 +200,55 @@ struct krdma_cb {
 		struct {
 			krdma_rw_info_t *local_info;
 			krdma_rw_info_t *remote_info;
+			/*
+			 * Delta write-back: last known remote content, only the
+			 * cachelines differing from it are written.
+			 */
+			char *twin;
+			bool twin_valid;
+			struct krdma_delta_wrs *delta_wrs;
 		} rw_mr;
 	} mr;
 
 	struct completion cm_done;
 
+	/* Private data of the peer's connect request/reply. */
+	uint8_t peer_priv[KRDMA_PRIV_DATA_MAX];
+	uint8_t peer_priv_len;
+
 	struct list_head list;
+	/* Accept cb: the listen cb whose active_conn it is on, if any. */
+	struct krdma_cb *listen_cb;
 
+	/* Protects ready_conn and active_conn of a listen cb. */
+	spinlock_t conn_lock;
 	struct list_head ready_conn;
 	struct list_head active_conn;
 
+	/* Listen cb: accept requests on workers instead of krdma_accept(). */
+	int backlog;
+	struct krdma_accept_engine *accept_engine;
+	/* Accept cb: prepares the cb on an accept engine worker. */
+	struct work_struct accept_work;
+
 	int retry_count;
+
+	/*
+	 * Resilient client cbs reconnect to host:port in the background when the
+	 * connection breaks, and requests are replayed once reconnected.
+	 */
+	bool resilient;
+	char host[INET_ADDRSTRLEN];
+	char port[8];
+	atomic_t reconnecting;
+	/* Bumped by each successful reconnection. */
+	atomic_t conn_gen;
+	int reconnect_ret;
+	struct work_struct reconnect_work;
+	struct completion reconnected;
+
+	/* Set if the cb is owned by the connection pool. */
+	struct krdma_conn_entry *conn_entry;
 };
 
 #define DYNAMIC_POLLING_INTERVAL
@@ -161,15 +258,48 @@ void krdma_config(size_t max_buf_size);
 /* RDMA SEND/RECV APIs */
 int krdma_send(struct krdma_cb *cb, const char *buffer, size_t length);
 
-int krdma_receive(struct krdma_cb *cb, char *buffer);
+int krdma_receive(struct krdma_cb *cb, char *buffer, size_t length);
 
 /* Called with remote host & port */
 int krdma_connect(const char *host, const char *port, struct krdma_cb **conn_cb);
 
 int krdma_listen(const char *host, const char *port, struct krdma_cb **listen_cb);
 
+int krdma_listen_backlog(const char *host, const char *port, int backlog,
+		struct krdma_cb **listen_cb);
+
 int krdma_accept(struct krdma_cb *listen_cb, struct krdma_cb **accept_cb);
 
+/*
+ * Accept engine: connect requests of listen_cb are set up and accepted in
+ * parallel by nr_workers workers, and each established cb is handed to fn.
+ * fn runs on the worker, a non-zero return releases the cb.
+ */
+typedef int (*krdma_accept_fn_t)(struct krdma_cb *cb, void *data);
+
+int krdma_accept_engine_start(struct krdma_cb *listen_cb, int nr_workers,
+		krdma_accept_fn_t fn, void *data);
+
+void krdma_accept_engine_stop(struct krdma_cb *listen_cb);
+
+/* A remote peer of krdma_connect_mesh(). */
+struct krdma_peer {
+	const char *host;
+	const char *port;
+	bool read_write;
+
+	/* Set by krdma_connect_mesh(), cb is NULL on failure. */
+	struct krdma_cb *cb;
+	int ret;
+};
+
+/*
+ * Connect to all peers concurrently, retrying rejected connections without
+ * holding up the others. Returns once every peer is connected or has failed.
+ * @return the number of peers that failed.
+ */
+int krdma_connect_mesh(struct krdma_peer *peers, int nr_peers);
+
 /* RDMA SEND/RECV APIs */
 /* Called with remote host & port */
 int krdma_rw_init_client(const char *host, const char *port, struct krdma_cb **cbp);
@@ -180,7 +310,35 @@ int krdma_read(struct krdma_cb *cb, char *buffer, size_t length);
 
 int krdma_write(struct krdma_cb *cb, const char *buffer, size_t length);
 
+/*
+ * Make krdma_write() only ship the cachelines modified since the last sync.
+ * The peer still sees one write with immediate per krdma_write().
+ */
+int krdma_rw_set_delta(struct krdma_cb *cb, bool enable);
+
 /* RDMA release API */
 int krdma_release_cb(struct krdma_cb *cb);
 
+/* Release cb and free it, for cbs from krdma_connect() and krdma_accept(). */
+int krdma_free_cb(struct krdma_cb *cb);
+
+/*
+ * Reconnect a client cb transparently when its connection breaks. Requests
+ * that fail meanwhile wait up to KRDMA_RECONNECT_TIMEOUT and are replayed.
+ */
+int krdma_set_resilient(struct krdma_cb *cb, bool enable);
+
+/*
+ * Connection pool APIs. Connections are established on the first
+ * krdma_conn_get() of a (host, port, read_write) tuple, shared by all callers
+ * and kept connected after the last krdma_conn_put() until
+ * krdma_conn_pool_destroy().
+ */
+int krdma_conn_get(const char *host, const char *port, bool read_write,
+		struct krdma_cb **conn_cb);
+
+void krdma_conn_put(struct krdma_cb *cb);
+
+void krdma_conn_pool_destroy(void);
+
 #endif /* __KVM_X86_KRDMA_H */
@@ -29,18 +29,49 @@
 #include <asm/uaccess.h>
 #include <linux/socket.h>
 #include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <net/tcp.h>
 #include <linux/delay.h>
+#include <linux/wait.h>
+#include <linux/hrtimer.h>
+#include <linux/workqueue.h>
+#include <linux/sched/clock.h>
+#include <net/busy_poll.h>
 // #include <linux/kvm_host.h>
 
 #include "ktcp.h"
 
+/* Unsolicited frames waiting for ktcp_receive(), must be a power of 2. */
 #define KTCP_RECV_BUF_SIZE 32
+/* Enough for every parked message plus the one being received. */
+#define KTCP_POOL_SIZE (KTCP_RECV_BUF_SIZE + 1)
+/* Receive ring size, must be a power of 2. */
+#define KTCP_RING_SIZE (1U << 16)
+/* How long KTCP_RX_BUSY_POLL spins when no busy_poll budget is set. */
+#define KTCP_BUSY_POLL_USECS 50
+/* Batch buffer size, larger frames are never batched. */
+#define KTCP_BATCH_SIZE (64UL << 10)
+/* Anything larger is taken as a framing error. */
+#define KTCP_MAX_MSG_SIZE (64UL << 20)
+
+/* Never handed out: 0 is unused, 0xFF is what ktcp_send() uses. */
+#define KTCP_TXID_RESERVED(txid) ((txid) == 0 || (txid) == 0xFF)
+
+/* The frame answers the request with the same txid. */
+#define KTCP_HDR_REPLY 0x1
 
 struct ktcp_hdr {
 	size_t length;
 	tx_add_t tx_add;
+	uint16_t flags;
+	/* A negative errno fails the request, the reply then has no payload. */
+	int32_t status;
 } __attribute__((packed));
 
+/* Most payload kvecs a frame is sent from. */
+#define KTCP_FRAME_MAX_VEC 2
+
 typedef struct ktcp_msg
 {
 	uint16_t txid;
@@ -51,18 +82,97 @@ struct ktcp_cb
 {
 	struct mutex slock;
 	struct mutex rlock;
+	/* FIFO of parked unsolicited frames, under rlock, free running. */
 	ktcp_msg_t recv_trans_buf[KTCP_RECV_BUF_SIZE];
+	unsigned int trans_head;
+	unsigned int trans_tail;
 	struct socket *socket;
+
+	/*
+	 * Outstanding requests. A txid is owned by its requester from
+	 * ktcp_txid_alloc() to ktcp_txid_free(); a reply that arrives while
+	 * another thread reads the socket is parked in tx_slots[txid], under
+	 * rlock.
+	 */
+	spinlock_t txid_lock;
+	DECLARE_BITMAP(txid_map, KTCP_TXID_NR);
+	/* Woken by ktcp_txid_free(). */
+	wait_queue_head_t txid_wait;
+	unsigned int txid_next;
+	char *tx_slots[KTCP_TXID_NR];
+
+	/* Recycled receive buffers, under rlock. */
+	char *recv_pool[KTCP_POOL_SIZE];
+	int recv_pool_count;
+
+	/*
+	 * Receive ring, filled by reads as large as the socket allows and
+	 * parsed frame by frame, under rlock. rx_head and rx_tail are free
+	 * running.
+	 */
+	char *rx_ring;
+	unsigned int rx_head;
+	unsigned int rx_tail;
+	/* A frame larger than the ring, read in place, under rlock. */
+	char *rx_large;
+	size_t rx_large_got;
+
+	/*
+	 * Receivers sleep on rx_wait until the socket reports data, or until
+	 * rx_seq moves because a frame was parked for another receiver.
+	 */
+	enum ktcp_rx_mode rx_mode;
+	struct ktcp_tuning tuning;
+	wait_queue_head_t rx_wait;
+	unsigned int rx_seq;
+	void (*saved_data_ready)(struct sock *sk);
+	void (*saved_state_change)(struct sock *sk);
+
+	/*
+	 * Batching: frames are copied into batch_buf and go out in one sendmsg
+	 * when it fills, on ktcp_flush(), or batch_usecs after the first one,
+	 * under slock. The timer runs in softirq, so flush_work does the send.
+	 */
+	char *batch_buf;
+	size_t batch_len;
+	unsigned int batch_usecs;
+	struct hrtimer batch_timer;
+	struct work_struct flush_work;
 };
 
 #define KTCP_BUFFER_SIZE (sizeof(struct ktcp_hdr) + PAGE_SIZE)
 
-static int __ktcp_send(struct socket *sock, const char *buffer, size_t length)
+/*
+ * Called with cb->rlock held. A receive buffer holds the ktcp_hdr followed by
+ * the payload, only page sized ones are recycled.
+ */
+static char *ktcp_get_recv_buf(struct ktcp_cb *cb, size_t size)
 {
-	struct kvec vec;
-	int len, written = 0, left = length;
+	if (size > KTCP_BUFFER_SIZE)
+		return kvmalloc(size, GFP_KERNEL);
+	if (cb->recv_pool_count > 0)
+		return cb->recv_pool[--cb->recv_pool_count];
+	return kmalloc(KTCP_BUFFER_SIZE, GFP_KERNEL);
+}
+
+/* Called with cb->rlock held. */
+static void ktcp_put_recv_buf(struct ktcp_cb *cb, char *buf)
+{
+	struct ktcp_hdr hdr;
+
+	memcpy(&hdr, buf, sizeof(hdr));
+	if (hdr.length <= KTCP_BUFFER_SIZE && cb->recv_pool_count < KTCP_POOL_SIZE)
+		cb->recv_pool[cb->recv_pool_count++] = buf;
+	else
+		kvfree(buf);
+}
+
+static int __ktcp_send(struct socket *sock, struct kvec *vec, int nr_vec,
+		size_t length, unsigned long flags)
+{
+	int len;
+	size_t written = 0, left = length;
 	int ret;
-	unsigned long flags = 0;
 
 	struct msghdr msg = {
 		.msg_name    = 0,
@@ -73,10 +183,7 @@ static int __ktcp_send(struct socket *sock, const char *buffer, size_t length)
 	};
 
 repeat_send:
-	vec.iov_len = left;
-	vec.iov_base = (char *)buffer + written;
-
-	len = kernel_sendmsg(sock, &msg, &vec, 1, left);
+	len = kernel_sendmsg(sock, &msg, vec, nr_vec, left);
 	if (len == -EAGAIN || len == -ERESTARTSYS) {
 		goto repeat_send;
 	}
@@ -84,6 +191,14 @@ repeat_send:
 		written += len;
 		left -= len;
 		if (left != 0) {
+			/* Skip what has been sent. */
+			while (len >= vec->iov_len) {
+				len -= vec->iov_len;
+				vec++;
+				nr_vec--;
+			}
+			vec->iov_base = (char *)vec->iov_base + len;
+			vec->iov_len -= len;
 			goto repeat_send;
 		}
 	}
@@ -100,191 +215,909 @@ repeat_send:
 	return ret;
 }
 
-int ktcp_send(struct ktcp_cb *cb, const char *buffer, size_t length)
+/* Called with cb->slock held. */
+static int __ktcp_flush(struct ktcp_cb *cb)
 {
 	int ret;
 	mm_segment_t oldmm;
+	struct kvec vec;
+
+	if (!cb->batch_len)
+		return 0;
+
+	vec.iov_base = cb->batch_buf;
+	vec.iov_len = cb->batch_len;
+
+	oldmm = get_fs();
+	set_fs(KERNEL_DS);
+	ret = __ktcp_send(cb->socket, &vec, 1, cb->batch_len, 0);
+	set_fs(oldmm);
+
+	cb->batch_len = 0;
+	hrtimer_try_to_cancel(&cb->batch_timer);
+	return ret < 0 ? ret : 0;
+}
+
+int ktcp_flush(struct ktcp_cb *cb)
+{
+	int ret;
+
+	if (cb == NULL)
+		return -EINVAL;
+
+	mutex_lock(&cb->slock);
+	ret = __ktcp_flush(cb);
+	mutex_unlock(&cb->slock);
+	return ret;
+}
+EXPORT_SYMBOL_GPL(ktcp_flush);
+
+static void ktcp_flush_work(struct work_struct *work)
+{
+	struct ktcp_cb *cb = container_of(work, struct ktcp_cb, flush_work);
+
+	ktcp_flush(cb);
+}
+
+static enum hrtimer_restart ktcp_batch_timeout(struct hrtimer *timer)
+{
+	struct ktcp_cb *cb = container_of(timer, struct ktcp_cb, batch_timer);
+
+	schedule_work(&cb->flush_work);
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * Called with cb->slock held. Copy the frame into the batch.
+ * @return 1 if batched, 0 if it has to be sent on its own.
+ */
+static int ktcp_batch_frame(struct ktcp_cb *cb, struct kvec *vec, int nr_vec,
+		size_t size)
+{
+	bool first;
+	int i, ret;
+
+	if (!cb->batch_buf || size > KTCP_BATCH_SIZE)
+		return 0;
+
+	if (cb->batch_len + size > KTCP_BATCH_SIZE) {
+		ret = __ktcp_flush(cb);
+		if (ret < 0)
+			return ret;
+	}
+
+	first = cb->batch_len == 0;
+	for (i = 0; i < nr_vec; ++i) {
+		memcpy(cb->batch_buf + cb->batch_len, vec[i].iov_base, vec[i].iov_len);
+		cb->batch_len += vec[i].iov_len;
+	}
+	if (first)
+		hrtimer_start(&cb->batch_timer,
+				ns_to_ktime((u64)cb->batch_usecs * NSEC_PER_USEC),
+				HRTIMER_MODE_REL);
+	return 1;
+}
+
+/* Send a frame whose payload is gathered from nr_payload kvecs. */
+static int ktcp_send_frame(struct ktcp_cb *cb, uint16_t txid, uint16_t flags,
+		int32_t status, const struct kvec *payload, int nr_payload)
+{
+	int i, ret;
+	size_t length = 0;
+	mm_segment_t oldmm;
 	struct ktcp_hdr hdr;
-	char *local_buffer;
-	tx_add_t tx_add = { .txid = 0xFF };
+	struct kvec vec[1 + KTCP_FRAME_MAX_VEC];
+	tx_add_t tx_add = { .txid = txid };
+
+	BUG_ON(nr_payload > KTCP_FRAME_MAX_VEC);
+	for (i = 0; i < nr_payload; ++i) {
+		vec[1 + i] = payload[i];
+		length += payload[i].iov_len;
+	}
+	if (sizeof(hdr) + length > KTCP_MAX_MSG_SIZE)
+		return -EMSGSIZE;
 
 	mutex_lock(&cb->slock);
 	hdr.tx_add = tx_add;
 	hdr.length = sizeof(hdr) + length;
+	hdr.flags = flags;
+	hdr.status = status;
 
-	local_buffer = kzalloc(KTCP_BUFFER_SIZE, GFP_KERNEL);
-	if (!local_buffer) {
-		mutex_unlock(&cb->slock);
-		return -ENOMEM;
-	}
-	memcpy(local_buffer, &hdr, sizeof(hdr));
-	memcpy(local_buffer + sizeof(hdr), buffer, length);
+	/* Header and payload go out in one sendmsg, without copying either. */
+	vec[0].iov_base = &hdr;
+	vec[0].iov_len = sizeof(hdr);
+
+	ret = ktcp_batch_frame(cb, vec, 1 + nr_payload, sizeof(hdr) + length);
+	if (ret != 0)
+		goto out;
+	/* Keep the stream in order behind what is batched. */
+	ret = __ktcp_flush(cb);
+	if (ret < 0)
+		goto out;
 
 	// Get current address access limitdo
 	oldmm = get_fs();
 	set_fs(KERNEL_DS);
-	ret = __ktcp_send(cb->socket, local_buffer, sizeof(hdr) + length);
+	ret = __ktcp_send(cb->socket, vec, 1 + nr_payload, sizeof(hdr) + length, 0);
 	
 	// Retrieve address access limit
 	set_fs(oldmm);
-	kfree(local_buffer);
+out:
 	mutex_unlock(&cb->slock);
 	return ret < 0 ? ret : length;
 }
 
-static bool search_recv_buf(struct ktcp_cb *cb, uint16_t txid, ktcp_msg_t *msg)
+int ktcp_send(struct ktcp_cb *cb, const char *buffer, size_t length)
 {
-	int i;
+	struct kvec vec = { .iov_base = (char *)buffer, .iov_len = length };
 
-	for(i = 0; i < KTCP_RECV_BUF_SIZE; ++i)
-	{
-		if (cb->recv_trans_buf[i].txid == txid && cb->recv_trans_buf[i].recv_buf != NULL) {
-				*msg = cb->recv_trans_buf[i];
-				cb->recv_trans_buf[i].txid = 0;
-				cb->recv_trans_buf[i].recv_buf = NULL;
-				return true;
-		}
+	return ktcp_send_frame(cb, 0xFF, 0, 0, &vec, 1);
+}
+EXPORT_SYMBOL_GPL(ktcp_send);
+
+int ktcp_send_tx(struct ktcp_cb *cb, uint16_t txid, const char *buffer,
+		size_t length)
+{
+	struct kvec vec = { .iov_base = (char *)buffer, .iov_len = length };
+
+	return ktcp_send_frame(cb, txid, 0, 0, &vec, 1);
+}
+EXPORT_SYMBOL_GPL(ktcp_send_tx);
+
+int ktcp_reply_tx(struct ktcp_cb *cb, uint16_t txid, const char *buffer,
+		size_t length)
+{
+	struct kvec vec = { .iov_base = (char *)buffer, .iov_len = length };
+
+	return ktcp_send_frame(cb, txid, KTCP_HDR_REPLY, 0, &vec, 1);
+}
+EXPORT_SYMBOL_GPL(ktcp_reply_tx);
+
+int ktcp_reply_err(struct ktcp_cb *cb, uint16_t txid, int err)
+{
+	return ktcp_send_frame(cb, txid, KTCP_HDR_REPLY, err, NULL, 0);
+}
+EXPORT_SYMBOL_GPL(ktcp_reply_err);
+
+static struct page *ktcp_buf_page(const char *buf)
+{
+	if (is_vmalloc_addr(buf))
+		return vmalloc_to_page(buf);
+	if (virt_addr_valid(buf))
+		return virt_to_page(buf);
+	return NULL;
+}
+
+/* Slab pages cannot be handed to the network stack by reference. */
+static bool ktcp_zerocopy_ok(const char *buffer, size_t length)
+{
+	size_t off;
+	struct page *page;
+
+	if (offset_in_page(buffer) != 0 || length < PAGE_SIZE)
+		return false;
+
+	for (off = 0; off < length; off += PAGE_SIZE) {
+		page = ktcp_buf_page(buffer + off);
+		if (!page || PageSlab(page) || !page_count(page))
+			return false;
 	}
-	return false;
+	return true;
 }
 
-static bool insert_into_recv_buf(struct ktcp_cb *cb, ktcp_msg_t msg)
+static int __ktcp_sendpage(struct socket *sock, struct page *page, size_t size,
+		int flags)
 {
-	int i;
+	int len;
+	size_t offset = 0;
 
-	for(i = 0; i < KTCP_RECV_BUF_SIZE; ++i)
-	{ 
-		if (cb->recv_trans_buf[i].txid == 0 && cb->recv_trans_buf[i].recv_buf == NULL) {
-				cb->recv_trans_buf[i] = msg;
-				return true;
-		}
+repeat_send:
+	len = kernel_sendpage(sock, page, offset, size - offset, flags);
+	if (len == -EAGAIN || len == -ERESTARTSYS) {
+		goto repeat_send;
+	}
+	if (len < 0) {
+		printk(KERN_ERR "ktcp_sendpage %d", len);
+		return len;
+	}
+	offset += len;
+	if (offset < size) {
+		goto repeat_send;
+	}
+	return size;
+}
+
+/* Wait until the peer has acknowledged everything up to end_seq. */
+static int ktcp_wait_acked(struct socket *sock, u32 end_seq)
+{
+	struct sock *sk = sock->sk;
+	uint32_t usec_sleep = 0;
+
+	while (before(READ_ONCE(tcp_sk(sk)->snd_una), end_seq)) {
+		if (sk->sk_err)
+			return -sk->sk_err;
+		if (sk->sk_state == TCP_CLOSE)
+			return -EPIPE;
+		usec_sleep = (usec_sleep + 1) > 1000 ? 1000 : (usec_sleep + 1);
+		usleep_range(usec_sleep, usec_sleep);
+	}
+	return 0;
+}
+
+int ktcp_send_zerocopy(struct ktcp_cb *cb, const char *buffer, size_t length)
+{
+	int ret;
+	size_t off, size;
+	u32 end_seq;
+	mm_segment_t oldmm;
+	struct ktcp_hdr hdr;
+	struct kvec vec;
+	tx_add_t tx_add = { .txid = 0xFF };
+
+	if (!ktcp_zerocopy_ok(buffer, length))
+		return ktcp_send(cb, buffer, length);
+	if (sizeof(hdr) + length > KTCP_MAX_MSG_SIZE)
+		return -EMSGSIZE;
+
+	mutex_lock(&cb->slock);
+	hdr.tx_add = tx_add;
+	hdr.length = sizeof(hdr) + length;
+	hdr.flags = 0;
+	hdr.status = 0;
+
+	vec.iov_base = &hdr;
+	vec.iov_len = sizeof(hdr);
+
+	ret = __ktcp_flush(cb);
+	if (ret < 0) {
+		mutex_unlock(&cb->slock);
+		return ret;
 	}
 
-	return false;
+	oldmm = get_fs();
+	set_fs(KERNEL_DS);
+	ret = __ktcp_send(cb->socket, &vec, 1, sizeof(hdr), MSG_MORE);
+	set_fs(oldmm);
+
+	/* The pages are attached to skbs by reference. */
+	for (off = 0; ret >= 0 && off < length; off += PAGE_SIZE) {
+		size = min_t(size_t, PAGE_SIZE, length - off);
+		ret = __ktcp_sendpage(cb->socket, ktcp_buf_page(buffer + off), size,
+				off + size < length ? MSG_MORE : 0);
+	}
+	end_seq = READ_ONCE(tcp_sk(cb->socket->sk)->write_seq);
+	mutex_unlock(&cb->slock);
+
+	/* Completion: the caller may reuse the pages once this returns. */
+	if (ret >= 0)
+		ret = ktcp_wait_acked(cb->socket, end_seq);
+	return ret < 0 ? ret : length;
 }
+EXPORT_SYMBOL_GPL(ktcp_send_zerocopy);
 
-static int build_ktcp_recv_output(ktcp_msg_t msg, char *buffer, tx_add_t *tx_add)
+static bool ktcp_trans_pop(struct ktcp_cb *cb, ktcp_msg_t *msg)
+{
+	if (cb->trans_head == cb->trans_tail)
+		return false;
+	*msg = cb->recv_trans_buf[cb->trans_head++ & (KTCP_RECV_BUF_SIZE - 1)];
+	return true;
+}
+
+static inline bool ktcp_trans_full(struct ktcp_cb *cb)
+{
+	return cb->trans_tail - cb->trans_head == KTCP_RECV_BUF_SIZE;
+}
+
+static void ktcp_trans_push(struct ktcp_cb *cb, ktcp_msg_t msg)
+{
+	cb->recv_trans_buf[cb->trans_tail++ & (KTCP_RECV_BUF_SIZE - 1)] = msg;
+}
+
+/* A payload larger than len is dropped, and -EMSGSIZE returned. */
+static int build_ktcp_recv_output(struct ktcp_cb *cb, char *recv_buf,
+		char *buffer, size_t len)
 {
 	size_t real_length;
 	struct ktcp_hdr hdr;
-	memcpy(&hdr, (char *)msg.recv_buf, sizeof(struct ktcp_hdr));
+	memcpy(&hdr, recv_buf, sizeof(struct ktcp_hdr));
+	if (hdr.status < 0) {
+		ktcp_put_recv_buf(cb, recv_buf);
+		return hdr.status;
+	}
 	real_length = hdr.length - sizeof(struct ktcp_hdr);
-	memcpy(buffer, (char *)msg.recv_buf + sizeof(struct ktcp_hdr), real_length);
-	*tx_add = hdr.tx_add;
-	kfree(msg.recv_buf);
+	if (real_length > len) {
+		ktcp_put_recv_buf(cb, recv_buf);
+		return -EMSGSIZE;
+	}
+	memcpy(buffer, recv_buf + sizeof(struct ktcp_hdr), real_length);
+	ktcp_put_recv_buf(cb, recv_buf);
 	return real_length;
 }
 
-static int __ktcp_receive(struct socket *sock, char *buffer, size_t expected_size,
-		unsigned long flags)
+static inline unsigned int ktcp_ring_used(struct ktcp_cb *cb)
+{
+	return cb->rx_tail - cb->rx_head;
+}
+
+/* Copy len bytes at offset off of the ring without consuming them. */
+static void ktcp_ring_peek(struct ktcp_cb *cb, unsigned int off, void *dst,
+		size_t len)
+{
+	unsigned int start = (cb->rx_head + off) & (KTCP_RING_SIZE - 1);
+	size_t first = min_t(size_t, len, KTCP_RING_SIZE - start);
+
+	memcpy(dst, cb->rx_ring + start, first);
+	memcpy((char *)dst + first, cb->rx_ring, len - first);
+}
+
+static int __ktcp_receive(struct socket *sock, struct kvec *vec, int nr_vec,
+		size_t size)
 {
-	struct kvec vec;
 	int ret;
-	int len = 0;
-	
+
 	struct msghdr msg = {
 		.msg_name    = 0,
 		.msg_namelen = 0,
 		.msg_control = NULL,
 		.msg_controllen = 0,
-		.msg_flags   = flags | MSG_DONTWAIT,
+		.msg_flags   = MSG_DONTWAIT,
 	};
 
-	if (expected_size == 0) {
+	ret = kernel_recvmsg(sock, &msg, vec, nr_vec, size, MSG_DONTWAIT);
+	if (ret == 0) {
+		/* Orderly shutdown by the peer. */
+		return -ECONNRESET;
+	}
+	if (ret == -ERESTARTSYS || ret == -EWOULDBLOCK) {
+		return -EAGAIN;
+	}
+	if (ret < 0) {
+		printk(KERN_ERR "kernel_recvmsg %d\n", ret);
+	}
+	return ret;
+}
+
+/*
+ * Read whatever the socket has, into the free space of the ring or into the
+ * rest of a large frame.
+ * @return bytes read, -EAGAIN if there is nothing to read.
+ */
+static int ktcp_fill(struct ktcp_cb *cb)
+{
+	struct kvec vec[2];
+	struct ktcp_hdr hdr;
+	unsigned int free, start;
+	int nr_vec = 1, ret;
+
+	if (cb->rx_large) {
+		memcpy(&hdr, cb->rx_large, sizeof(hdr));
+		vec[0].iov_base = cb->rx_large + cb->rx_large_got;
+		vec[0].iov_len = hdr.length - cb->rx_large_got;
+		ret = __ktcp_receive(cb->socket, vec, 1, vec[0].iov_len);
+		if (ret > 0)
+			cb->rx_large_got += ret;
+		return ret;
+	}
+
+	free = KTCP_RING_SIZE - ktcp_ring_used(cb);
+	start = cb->rx_tail & (KTCP_RING_SIZE - 1);
+	BUG_ON(free == 0);
+
+	vec[0].iov_base = cb->rx_ring + start;
+	vec[0].iov_len = min(free, KTCP_RING_SIZE - start);
+	if (vec[0].iov_len < free) {
+		vec[1].iov_base = cb->rx_ring;
+		vec[1].iov_len = free - vec[0].iov_len;
+		nr_vec = 2;
+	}
+	ret = __ktcp_receive(cb->socket, vec, nr_vec, free);
+	if (ret > 0)
+		cb->rx_tail += ret;
+	return ret;
+}
+
+/*
+ * Look at the frame at the head of the stream and fill in its header.
+ * @return 1 if the whole frame has arrived, 0 if more data is needed.
+ */
+static int ktcp_next_frame(struct ktcp_cb *cb, struct ktcp_hdr *hdr)
+{
+	unsigned int used = ktcp_ring_used(cb);
+
+	if (cb->rx_large) {
+		memcpy(hdr, cb->rx_large, sizeof(*hdr));
+		return cb->rx_large_got == hdr->length;
+	}
+
+	if (used < sizeof(*hdr))
 		return 0;
+	ktcp_ring_peek(cb, 0, hdr, sizeof(*hdr));
+	if (hdr->length < sizeof(*hdr) || hdr->length > KTCP_MAX_MSG_SIZE) {
+		printk(KERN_ERR "%s: bad frame length %lu\n", __func__, hdr->length);
+		return -EPROTO;
 	}
+	if (hdr->length <= used)
+		return 1;
+	if (hdr->length <= KTCP_RING_SIZE)
+		return 0;
 
-read_again:
-	vec.iov_len = expected_size - len;
-	vec.iov_base = buffer + len;
-	ret = kernel_recvmsg(sock, &msg, &vec, 1, expected_size - len, flags | MSG_DONTWAIT);
+	/* Does not fit in the ring, the rest is read in place. */
+	cb->rx_large = kvmalloc(hdr->length, GFP_KERNEL);
+	if (!cb->rx_large)
+		return -ENOMEM;
+	ktcp_ring_peek(cb, 0, cb->rx_large, used);
+	cb->rx_head += used;
+	cb->rx_large_got = used;
+	return 0;
+}
 
-	if (ret == 0) {
-		return len;
+/*
+ * Copy the payload of the complete frame at the head to buffer, or drop it
+ * if it is larger than len.
+ * @return the payload length, or -EMSGSIZE.
+ */
+static int ktcp_deliver_frame(struct ktcp_cb *cb, struct ktcp_hdr *hdr,
+		char *buffer, size_t len)
+{
+	size_t real_length = hdr->length - sizeof(*hdr);
+	bool fits = real_length <= len;
+
+	if (cb->rx_large) {
+		if (fits)
+			memcpy(buffer, cb->rx_large + sizeof(*hdr), real_length);
+		kvfree(cb->rx_large);
+		cb->rx_large = NULL;
+	} else {
+		if (fits)
+			ktcp_ring_peek(cb, sizeof(*hdr), buffer, real_length);
+		cb->rx_head += hdr->length;
 	}
+	return fits ? real_length : -EMSGSIZE;
+}
 
-	// Non-blocking on the first try
-	if (len == 0 && (flags & SOCK_NONBLOCK) &&
-			(ret == -EWOULDBLOCK || ret == -EAGAIN)) {
-		return ret;
+/* Move the complete frame at the head into a buffer of its own. */
+static int ktcp_detach_frame(struct ktcp_cb *cb, struct ktcp_hdr *hdr,
+		ktcp_msg_t *msg)
+{
+	char *buf;
+
+	if (cb->rx_large) {
+		buf = cb->rx_large;
+		cb->rx_large = NULL;
+	} else {
+		buf = ktcp_get_recv_buf(cb, hdr->length);
+		if (!buf)
+			return -ENOMEM;
+		ktcp_ring_peek(cb, 0, buf, hdr->length);
+		cb->rx_head += hdr->length;
 	}
+	msg->recv_buf = buf;
+	msg->txid = hdr->tx_add.txid;
+	return 0;
+}
 
-	if (ret == -EAGAIN || ret == -ERESTARTSYS) {
-		goto read_again;
+static void ktcp_data_ready(struct sock *sk)
+{
+	struct ktcp_cb *cb;
+	void (*ready)(struct sock *sk) = NULL;
+
+	read_lock_bh(&sk->sk_callback_lock);
+	cb = sk->sk_user_data;
+	if (cb) {
+		ready = cb->saved_data_ready;
+		wake_up_interruptible(&cb->rx_wait);
 	}
-	else if (ret < 0) {
-		printk(KERN_ERR "kernel_recvmsg %d\n", ret);
-		return ret;
+	read_unlock_bh(&sk->sk_callback_lock);
+	if (ready)
+		ready(sk);
+}
+
+static void ktcp_state_change(struct sock *sk)
+{
+	struct ktcp_cb *cb;
+	void (*change)(struct sock *sk) = NULL;
+
+	read_lock_bh(&sk->sk_callback_lock);
+	cb = sk->sk_user_data;
+	if (cb) {
+		change = cb->saved_state_change;
+		wake_up_interruptible(&cb->rx_wait);
 	}
-	len += ret;
-	if (len != expected_size) {
-		printk(KERN_WARNING "ktcp_receive receive %d bytes which expected_size=%lu bytes, read again", len, expected_size);
-		goto read_again;
+	read_unlock_bh(&sk->sk_callback_lock);
+	if (change)
+		change(sk);
+}
+
+static void ktcp_install_callbacks(struct ktcp_cb *cb)
+{
+	struct sock *sk = cb->socket->sk;
+
+	write_lock_bh(&sk->sk_callback_lock);
+	cb->saved_data_ready = sk->sk_data_ready;
+	cb->saved_state_change = sk->sk_state_change;
+	sk->sk_user_data = cb;
+	sk->sk_data_ready = ktcp_data_ready;
+	sk->sk_state_change = ktcp_state_change;
+	write_unlock_bh(&sk->sk_callback_lock);
+}
+
+static void ktcp_restore_callbacks(struct ktcp_cb *cb)
+{
+	struct sock *sk = cb->socket->sk;
+
+	write_lock_bh(&sk->sk_callback_lock);
+	if (sk->sk_user_data == cb) {
+		sk->sk_data_ready = cb->saved_data_ready;
+		sk->sk_state_change = cb->saved_state_change;
+		sk->sk_user_data = NULL;
+	}
+	write_unlock_bh(&sk->sk_callback_lock);
+}
+
+static bool ktcp_rx_pending(struct ktcp_cb *cb, unsigned int seq,
+		bool need_data)
+{
+	struct sock *sk = cb->socket->sk;
+
+	if (READ_ONCE(cb->rx_seq) != seq)
+		return true;
+	if (!need_data)
+		return false;
+	return !skb_queue_empty(&sk->sk_receive_queue) ||
+		sk->sk_err || (sk->sk_shutdown & RCV_SHUTDOWN);
+}
+
+/*
+ * Spin on the socket, polling the device queue when the driver supports it,
+ * for up to tuning.busy_poll usecs, then sleep as in event mode.
+ */
+static void ktcp_busy_poll(struct ktcp_cb *cb, unsigned int seq, bool need_data)
+{
+	struct sock *sk __maybe_unused = cb->socket->sk;
+	unsigned int usecs = cb->tuning.busy_poll ?: KTCP_BUSY_POLL_USECS;
+	u64 end = local_clock() + (u64)usecs * NSEC_PER_USEC;
+
+	while (!ktcp_rx_pending(cb, seq, need_data)) {
+		if (local_clock() >= end) {
+			wait_event_interruptible_timeout(cb->rx_wait,
+					ktcp_rx_pending(cb, seq, need_data), HZ);
+			return;
+		}
+#ifdef CONFIG_NET_RX_BUSY_POLL
+		if (need_data && sk_can_busy_loop(sk)) {
+			sk_busy_loop(sk, 1);
+			continue;
+		}
+#endif
+		cpu_relax();
+		cond_resched();
 	}
+}
 
-	return len;
+/*
+ * Called with cb->rlock held, which is dropped while waiting for the socket
+ * to become readable, or with !need_data only for another receiver to make
+ * progress.
+ */
+static void ktcp_rx_wait(struct ktcp_cb *cb, uint32_t *usec_sleep,
+		bool need_data)
+{
+	unsigned int seq = cb->rx_seq;
+
+	mutex_unlock(&cb->rlock);
+	if (cb->rx_mode == KTCP_RX_BUSY_POLL) {
+		ktcp_busy_poll(cb, seq, need_data);
+	} else if (cb->rx_mode == KTCP_RX_EVENT) {
+		/* The timeout only guards against a missed wakeup. */
+		wait_event_interruptible_timeout(cb->rx_wait,
+				ktcp_rx_pending(cb, seq, need_data), HZ);
+	} else {
+		*usec_sleep = (*usec_sleep + 1) > 1000 ? 1000 : (*usec_sleep + 1);
+		usleep_range(*usec_sleep, *usec_sleep);
+	}
+	mutex_lock(&cb->rlock);
 }
 
-int ktcp_receive(struct ktcp_cb *cb, char *buffer)
+int ktcp_set_batch(struct ktcp_cb *cb, unsigned int usecs)
+{
+	char *buf = NULL;
+	int ret;
+
+	if (cb == NULL || cb->saved_data_ready == NULL)
+		return -EINVAL;
+
+	if (usecs) {
+		mutex_lock(&cb->slock);
+		if (!cb->batch_buf) {
+			cb->batch_buf = kvmalloc(KTCP_BATCH_SIZE, GFP_KERNEL);
+			if (!cb->batch_buf) {
+				mutex_unlock(&cb->slock);
+				return -ENOMEM;
+			}
+		}
+		cb->batch_usecs = usecs;
+		mutex_unlock(&cb->slock);
+		return SUCCESS;
+	}
+
+	mutex_lock(&cb->slock);
+	ret = __ktcp_flush(cb);
+	swap(buf, cb->batch_buf);
+	mutex_unlock(&cb->slock);
+
+	hrtimer_cancel(&cb->batch_timer);
+	cancel_work_sync(&cb->flush_work);
+	kvfree(buf);
+	return ret;
+}
+EXPORT_SYMBOL_GPL(ktcp_set_batch);
+
+int ktcp_set_rx_mode(struct ktcp_cb *cb, enum ktcp_rx_mode mode)
+{
+	if (cb == NULL || (mode != KTCP_RX_EVENT && mode != KTCP_RX_POLL &&
+			mode != KTCP_RX_BUSY_POLL))
+		return -EINVAL;
+
+	WRITE_ONCE(cb->rx_mode, mode);
+	wake_up_interruptible(&cb->rx_wait);
+	return SUCCESS;
+}
+EXPORT_SYMBOL_GPL(ktcp_set_rx_mode);
+
+static int ktcp_setsockopt_int(struct socket *sock, int level, int optname,
+		int val)
+{
+	return kernel_setsockopt(sock, level, optname, (char *)&val, sizeof(val));
+}
+
+static int ktcp_apply_tuning(struct socket *sock,
+		const struct ktcp_tuning *tuning)
+{
+	int ret = 0;
+
+	if (tuning->nodelay)
+		ret = ktcp_setsockopt_int(sock, SOL_TCP, TCP_NODELAY, 1);
+	if (!ret && tuning->quickack)
+		ret = ktcp_setsockopt_int(sock, SOL_TCP, TCP_QUICKACK, 1);
+	if (!ret && tuning->sndbuf)
+		ret = ktcp_setsockopt_int(sock, SOL_SOCKET, SO_SNDBUF, tuning->sndbuf);
+	if (!ret && tuning->rcvbuf)
+		ret = ktcp_setsockopt_int(sock, SOL_SOCKET, SO_RCVBUF, tuning->rcvbuf);
+	if (!ret && tuning->busy_poll)
+		ret = ktcp_setsockopt_int(sock, SOL_SOCKET, SO_BUSY_POLL,
+				tuning->busy_poll);
+	if (ret < 0)
+		printk(KERN_ERR "%s: kernel_setsockopt failed, return %d\n",
+				__func__, ret);
+	return ret;
+}
+
+/*
+ * The stack leaves quickack mode on its own once it sees an interactive
+ * exchange. Turn it back on only then, rather than pay a setsockopt for
+ * every read.
+ */
+static void ktcp_rearm_quickack(struct ktcp_cb *cb)
+{
+	if (cb->tuning.quickack &&
+			READ_ONCE(inet_csk(cb->socket->sk)->icsk_ack.pingpong))
+		ktcp_setsockopt_int(cb->socket, SOL_TCP, TCP_QUICKACK, 1);
+}
+
+/* Called with cb->rlock held, tells the other receivers to look again. */
+static inline void ktcp_rx_kick(struct ktcp_cb *cb)
+{
+	cb->rx_seq++;
+	wake_up_interruptible(&cb->rx_wait);
+}
+
+/* Park the reply at the head for its requester, or drop it if it has gone. */
+static int ktcp_park_reply(struct ktcp_cb *cb, struct ktcp_hdr *hdr)
+{
+	uint16_t txid = hdr->tx_add.txid;
+	ktcp_msg_t msg;
+	int ret;
+
+	ret = ktcp_detach_frame(cb, hdr, &msg);
+	if (ret < 0)
+		return ret;
+	if (txid >= KTCP_TXID_NR || !test_bit(txid, cb->txid_map) ||
+			cb->tx_slots[txid]) {
+		printk(KERN_WARNING "%s: drop reply to txid 0x%x\n", __func__, txid);
+		ktcp_put_recv_buf(cb, msg.recv_buf);
+		return 0;
+	}
+	cb->tx_slots[txid] = msg.recv_buf;
+	return 0;
+}
+
+/*
+ * Receive the reply to txid, or with !reply the next frame that is not a
+ * reply, into buffer of len bytes. Whichever receiver holds rlock reads the
+ * socket and parks the frames meant for the others. Called with cb->rlock
+ * held.
+ */
+static int ktcp_receive_frame(struct ktcp_cb *cb, bool reply, uint16_t *txid,
+		char *buffer, size_t len)
 {
 	struct ktcp_hdr hdr;
 	int ret;
 	ktcp_msg_t msg;
 	uint32_t usec_sleep = 0;
-	char *local_buffer;
-	tx_add_t tx_add = { .txid = 0xFF };
-	unsigned long flags = 0;
-
-	BUG_ON(cb == NULL || buffer == NULL);
 
-	mutex_lock(&cb->rlock);
 repoll:
-	if (search_recv_buf(cb, 0xFF, &msg)){
-		ret = build_ktcp_recv_output(msg, buffer, &tx_add);
-		mutex_unlock(&cb->rlock);
+	if (reply && cb->tx_slots[*txid]) {
+		ret = build_ktcp_recv_output(cb, cb->tx_slots[*txid], buffer, len);
+		cb->tx_slots[*txid] = NULL;
 		return ret;
 	}
-	local_buffer = kzalloc(KTCP_BUFFER_SIZE, GFP_KERNEL);
-	if (!local_buffer) {
-		ret = -ENOMEM;
-		goto out;
+	if (!reply && ktcp_trans_pop(cb, &msg)) {
+		*txid = msg.txid;
+		ret = build_ktcp_recv_output(cb, msg.recv_buf, buffer, len);
+		/* There is room in the FIFO again. */
+		ktcp_rx_kick(cb);
+		return ret;
 	}
-	ret = __ktcp_receive(cb->socket, local_buffer, KTCP_BUFFER_SIZE, flags);
-	if (ret < 0) {
+
+	ret = ktcp_next_frame(cb, &hdr);
+	if (ret < 0)
+		return ret;
+	if (ret == 0) {
+		/* One read may bring in many frames, parsed by the next rounds. */
+		ret = ktcp_fill(cb);
 		if (ret == -EAGAIN) {
-			mutex_unlock(&cb->rlock);
-			usec_sleep = (usec_sleep + 1) > 1000 ? 1000 : (usec_sleep + 1);
-			usleep_range(usec_sleep, usec_sleep);
-			mutex_lock(&cb->rlock);
-			kfree(local_buffer);
+			ktcp_rx_wait(cb, &usec_sleep, true);
 			goto repoll;
 		}
-		kfree(local_buffer);
-		printk(KERN_ERR "%s: __ktcp_receive error, ret %d\n",
-				__func__, ret);
-		goto out;
-	}
-	usec_sleep = 0;
-	memcpy(&hdr, local_buffer, sizeof(hdr));
-	msg.recv_buf = local_buffer;
-	msg.txid = hdr.tx_add.txid;
-	if (hdr.tx_add.txid != tx_add.txid && tx_add.txid != 0xFF){
-		while(!insert_into_recv_buf(cb, msg)){
-			mutex_unlock(&cb->rlock);
-			usec_sleep = (usec_sleep + 1) > 1000 ? 1000 : (usec_sleep + 1);
-			usleep_range(usec_sleep, usec_sleep);
-			mutex_lock(&cb->rlock);
-		}
+		if (ret < 0)
+			return ret;
+		ktcp_rearm_quickack(cb);
 		usec_sleep = 0;
 		goto repoll;
 	}
-	else{
-		build_ktcp_recv_output(msg, buffer, &tx_add);
+
+	if (!!(hdr.flags & KTCP_HDR_REPLY) == reply &&
+			(!reply || hdr.tx_add.txid == *txid)) {
+		*txid = hdr.tx_add.txid;
+		ret = ktcp_deliver_frame(cb, &hdr, buffer, len);
+		return hdr.status < 0 ? hdr.status : ret;
 	}
-out:
+
+	if (hdr.flags & KTCP_HDR_REPLY) {
+		ret = ktcp_park_reply(cb, &hdr);
+	} else if (ktcp_trans_full(cb)) {
+		/*
+		 * Backpressure: leave the frame where it is, and the rest of the
+		 * stream in the socket, until ktcp_receive() drains the FIFO.
+		 */
+		ktcp_rx_wait(cb, &usec_sleep, false);
+		goto repoll;
+	} else {
+		ret = ktcp_detach_frame(cb, &hdr, &msg);
+		if (ret == 0)
+			ktcp_trans_push(cb, msg);
+	}
+	if (ret < 0)
+		return ret;
+	ktcp_rx_kick(cb);
+	usec_sleep = 0;
+	goto repoll;
+}
+
+/*
+ * What we wait for may answer a frame still sitting in the batch, flush it
+ * rather than wait for the batch timer.
+ */
+static int ktcp_flush_pending(struct ktcp_cb *cb)
+{
+	if (!READ_ONCE(cb->batch_len))
+		return 0;
+	return ktcp_flush(cb);
+}
+
+int ktcp_receive(struct ktcp_cb *cb, char *buffer, size_t len)
+{
+	int ret;
+	uint16_t txid;
+
+	BUG_ON(cb == NULL || buffer == NULL);
+
+	ret = ktcp_flush_pending(cb);
+	if (ret < 0)
+		return ret;
+
+	mutex_lock(&cb->rlock);
+	ret = ktcp_receive_frame(cb, false, &txid, buffer, len);
 	mutex_unlock(&cb->rlock);
-	return ret < 0 ? ret : hdr.length - sizeof(struct ktcp_hdr);
+	if (ret < 0)
+		printk(KERN_ERR "%s: receive error, ret %d\n", __func__, ret);
+	return ret;
 }
+EXPORT_SYMBOL_GPL(ktcp_receive);
+
+int ktcp_receive_req(struct ktcp_cb *cb, char *buffer, size_t len,
+		uint16_t *txid)
+{
+	int ret;
+
+	BUG_ON(cb == NULL || buffer == NULL || txid == NULL);
+
+	ret = ktcp_flush_pending(cb);
+	if (ret < 0)
+		return ret;
+
+	mutex_lock(&cb->rlock);
+	ret = ktcp_receive_frame(cb, false, txid, buffer, len);
+	mutex_unlock(&cb->rlock);
+	if (ret < 0)
+		printk(KERN_ERR "%s: receive error, ret %d\n", __func__, ret);
+	return ret;
+}
+EXPORT_SYMBOL_GPL(ktcp_receive_req);
+
+int ktcp_receive_tx(struct ktcp_cb *cb, uint16_t txid, char *buffer,
+		size_t len)
+{
+	int ret;
+
+	BUG_ON(cb == NULL || buffer == NULL);
+	if (txid >= KTCP_TXID_NR || !test_bit(txid, cb->txid_map))
+		return -EINVAL;
+
+	ret = ktcp_flush_pending(cb);
+	if (ret < 0)
+		return ret;
+
+	mutex_lock(&cb->rlock);
+	ret = ktcp_receive_frame(cb, true, &txid, buffer, len);
+	mutex_unlock(&cb->rlock);
+	if (ret < 0)
+		printk(KERN_ERR "%s: receive error, ret %d\n", __func__, ret);
+	return ret;
+}
+EXPORT_SYMBOL_GPL(ktcp_receive_tx);
+
+int ktcp_txid_alloc(struct ktcp_cb *cb, uint16_t *txid)
+{
+	unsigned int id;
+
+	spin_lock(&cb->txid_lock);
+	/* Go round the space so that a stale reply hits a free txid. */
+	id = find_next_zero_bit(cb->txid_map, KTCP_TXID_NR, cb->txid_next);
+	if (id >= KTCP_TXID_NR)
+		id = find_first_zero_bit(cb->txid_map, KTCP_TXID_NR);
+	if (id >= KTCP_TXID_NR) {
+		spin_unlock(&cb->txid_lock);
+		return -EAGAIN;
+	}
+	set_bit(id, cb->txid_map);
+	cb->txid_next = id + 1;
+	spin_unlock(&cb->txid_lock);
+
+	*txid = id;
+	return SUCCESS;
+}
+EXPORT_SYMBOL_GPL(ktcp_txid_alloc);
+
+void ktcp_txid_free(struct ktcp_cb *cb, uint16_t txid)
+{
+	if (txid >= KTCP_TXID_NR || KTCP_TXID_RESERVED(txid))
+		return;
+
+	/* Drop a reply that came in after the requester gave up. */
+	mutex_lock(&cb->rlock);
+	if (cb->tx_slots[txid]) {
+		ktcp_put_recv_buf(cb, cb->tx_slots[txid]);
+		cb->tx_slots[txid] = NULL;
+	}
+	mutex_unlock(&cb->rlock);
+
+	spin_lock(&cb->txid_lock);
+	clear_bit(txid, cb->txid_map);
+	spin_unlock(&cb->txid_lock);
+	wake_up(&cb->txid_wait);
+}
+EXPORT_SYMBOL_GPL(ktcp_txid_free);
 
 static int ktcp_create_cb(struct ktcp_cb **cbp)
 {
@@ -294,17 +1127,61 @@ static int ktcp_create_cb(struct ktcp_cb **cbp)
 	cb = kzalloc(sizeof(*cb), GFP_KERNEL);
 	if (!cb)
 		return -ENOMEM;
+
+	cb->rx_ring = kvmalloc(KTCP_RING_SIZE, GFP_KERNEL);
+	if (!cb->rx_ring) {
+		kfree(cb);
+		return -ENOMEM;
+	}
 	
-	for(i = 0; i < KTCP_RECV_BUF_SIZE; ++i){
-		cb->recv_trans_buf[i].txid = 0;
-		cb->recv_trans_buf[i].recv_buf = NULL;
+	spin_lock_init(&cb->txid_lock);
+	init_waitqueue_head(&cb->txid_wait);
+	for (i = 0; i < KTCP_TXID_NR; ++i) {
+		if (KTCP_TXID_RESERVED(i))
+			set_bit(i, cb->txid_map);
 	}
 
 	*cbp = cb;
 	return 0;
 }
 
-int ktcp_connect(const char *host, const char *port, struct ktcp_cb **conn_cb)
+static void ktcp_init_conn(struct ktcp_cb *cb, struct socket *sock,
+		const struct ktcp_tuning *tuning)
+{
+	cb->socket = sock;
+	mutex_init(&cb->slock);
+	mutex_init(&cb->rlock);
+	init_waitqueue_head(&cb->rx_wait);
+	hrtimer_init(&cb->batch_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	cb->batch_timer.function = ktcp_batch_timeout;
+	INIT_WORK(&cb->flush_work, ktcp_flush_work);
+	cb->rx_mode = KTCP_RX_EVENT;
+	if (tuning) {
+		cb->tuning = *tuning;
+		if (tuning->busy_poll)
+			cb->rx_mode = KTCP_RX_BUSY_POLL;
+	}
+	ktcp_install_callbacks(cb);
+}
+
+static void ktcp_free_cb(struct ktcp_cb *cb)
+{
+	int i;
+	ktcp_msg_t msg;
+
+	while (ktcp_trans_pop(cb, &msg))
+		kvfree(msg.recv_buf);
+	for (i = 0; i < KTCP_TXID_NR; ++i)
+		kvfree(cb->tx_slots[i]);
+	for (i = 0; i < cb->recv_pool_count; ++i)
+		kfree(cb->recv_pool[i]);
+	kvfree(cb->rx_large);
+	kvfree(cb->rx_ring);
+	kfree(cb);
+}
+
+int ktcp_connect_tuned(const char *host, const char *port,
+		const struct ktcp_tuning *tuning, struct ktcp_cb **conn_cb)
 {
 	int ret;
 	struct sockaddr_in saddr;
@@ -320,14 +1197,26 @@ int ktcp_connect(const char *host, const char *port, struct ktcp_cb **conn_cb)
 	if (ret < 0) {
 		printk(KERN_ERR "%s: ktcp_create_cb fail, return %d\n",
 				__func__, ret);
+		return ret;
 	}
 
 	ret = sock_create(PF_INET, SOCK_STREAM, IPPROTO_TCP, &conn_socket);
 	if (ret < 0) {
 		printk(KERN_ERR "%s: sock_create failed, return %d\n", __func__, ret);
+		ktcp_free_cb(cb);
 		return ret;
 	}
 
+	/* Before connecting, so that the buffer sizes set the window scale. */
+	if (tuning) {
+		ret = ktcp_apply_tuning(conn_socket, tuning);
+		if (ret < 0) {
+			sock_release(conn_socket);
+			ktcp_free_cb(cb);
+			return ret;
+		}
+	}
+
 	memset(&saddr, 0, sizeof(saddr));
 	saddr.sin_family = AF_INET;
 	kstrtol(port, 10, &portdec);
@@ -344,15 +1233,21 @@ re_connect:
 	if (ret && (ret != -EINPROGRESS)) {
 		printk(KERN_ERR "%s: connct failed, return %d\n", __func__, ret);
 		sock_release(conn_socket);
+		ktcp_free_cb(cb);
 		return ret;
 	}
 
-	cb->socket = conn_socket;
-	mutex_init(&cb->slock);
-	mutex_init(&cb->rlock);
+	ktcp_init_conn(cb, conn_socket, tuning);
 	*conn_cb = cb;
 	return SUCCESS;
 }
+EXPORT_SYMBOL_GPL(ktcp_connect_tuned);
+
+int ktcp_connect(const char *host, const char *port, struct ktcp_cb **conn_cb)
+{
+	return ktcp_connect_tuned(host, port, NULL, conn_cb);
+}
+EXPORT_SYMBOL_GPL(ktcp_connect);
 
 int ktcp_listen(const char *host, const char *port, struct ktcp_cb **listen_cb)
 {
@@ -366,11 +1261,13 @@ int ktcp_listen(const char *host, const char *port, struct ktcp_cb **listen_cb)
 	if (ret < 0) {
 		printk(KERN_ERR "%s: ktcp_create_cb failed, return %d\n",
 				__func__, ret);
+		return ret;
 	}
 
 	ret = sock_create(PF_INET, SOCK_STREAM, IPPROTO_TCP, &listen_socket);
 	if (ret != 0) {
 		printk(KERN_ERR "%s: sock_create failed, return %d\n", __func__, ret);
+		ktcp_free_cb(cb);
 		return ret;
 	}
 	memset(&saddr, 0, sizeof(saddr));
@@ -383,6 +1280,7 @@ int ktcp_listen(const char *host, const char *port, struct ktcp_cb **listen_cb)
 	if (ret != 0) {
 		printk(KERN_ERR "%s: bind failed, return %d\n", __func__, ret);
 		sock_release(listen_socket);
+		ktcp_free_cb(cb);
 		return ret;
 	}
 
@@ -390,6 +1288,7 @@ int ktcp_listen(const char *host, const char *port, struct ktcp_cb **listen_cb)
 	if (ret != 0) {
 		printk(KERN_ERR "%s: listen failed, return %d\n", __func__, ret);
 		sock_release(listen_socket);
+		ktcp_free_cb(cb);
 		return ret;
 	}
 
@@ -397,8 +1296,10 @@ int ktcp_listen(const char *host, const char *port, struct ktcp_cb **listen_cb)
 	*listen_cb = cb;
 	return SUCCESS;
 }
+EXPORT_SYMBOL_GPL(ktcp_listen);
 
-int ktcp_accept(struct ktcp_cb *listen_cb, struct ktcp_cb **accept_cb)
+int ktcp_accept_tuned(struct ktcp_cb *listen_cb,
+		const struct ktcp_tuning *tuning, struct ktcp_cb **accept_cb)
 {
 	int ret;
 	struct ktcp_cb *cb;
@@ -414,12 +1315,14 @@ int ktcp_accept(struct ktcp_cb *listen_cb, struct ktcp_cb **accept_cb)
 	if (ret < 0) {
 		printk(KERN_ERR "%s: ktcp_create_cb failed, return %d\n",
 				__func__, ret);
+		return ret;
 	}
 
 	ret = sock_create_lite(listen_socket->sk->sk_family, listen_socket->sk->sk_type,
 			listen_socket->sk->sk_protocol, &accept_socket);
 	if (ret != 0) {
 		printk(KERN_ERR "%s: sock_create failed, return %d\n", __func__, ret);
+		ktcp_free_cb(cb);
 		return ret;
 	}
 
@@ -427,30 +1330,40 @@ re_accept:
 	ret = listen_socket->ops->accept(listen_socket, accept_socket, flag);
 	if (ret == -ERESTARTSYS) {
 		if (kthread_should_stop())
-			return ret;
+			goto out_release;
 		goto re_accept;
 	}
 	// When setting SOCK_NONBLOCK flag, accept return this when there's nothing in waiting queue.
-	if (ret == -EWOULDBLOCK || ret == -EAGAIN) {
-		sock_release(accept_socket);
-		accept_socket = NULL;
-		return ret;
-	}
+	if (ret == -EWOULDBLOCK || ret == -EAGAIN)
+		goto out_release;
 	if (ret < 0) {
 		printk(KERN_ERR "%s: accept failed, return %d\n", __func__, ret);
-		sock_release(accept_socket);
-		accept_socket = NULL;
-		return ret;
+		goto out_release;
 	}
 
 	accept_socket->ops = listen_socket->ops;
-	cb->socket = accept_socket;
-	mutex_init(&cb->slock);
-	mutex_init(&cb->rlock);
+	if (tuning) {
+		ret = ktcp_apply_tuning(accept_socket, tuning);
+		if (ret < 0)
+			goto out_release;
+	}
+	ktcp_init_conn(cb, accept_socket, tuning);
 	*accept_cb = cb;
 
 	return SUCCESS;
+
+out_release:
+	sock_release(accept_socket);
+	ktcp_free_cb(cb);
+	return ret;
+}
+EXPORT_SYMBOL_GPL(ktcp_accept_tuned);
+
+int ktcp_accept(struct ktcp_cb *listen_cb, struct ktcp_cb **accept_cb)
+{
+	return ktcp_accept_tuned(listen_cb, NULL, accept_cb);
 }
+EXPORT_SYMBOL_GPL(ktcp_accept);
 
 int ktcp_release(struct ktcp_cb *conn_cb)
 {
@@ -458,6 +1371,261 @@ int ktcp_release(struct ktcp_cb *conn_cb)
 		return -EINVAL;
 	}
 
+	if (conn_cb->batch_buf)
+		ktcp_set_batch(conn_cb, 0);
+	/* Listening cbs never had the callbacks installed. */
+	if (conn_cb->saved_data_ready)
+		ktcp_restore_callbacks(conn_cb);
 	sock_release(conn_cb->socket);
+	ktcp_free_cb(conn_cb);
+	return SUCCESS;
+}
+EXPORT_SYMBOL_GPL(ktcp_release);
+
+/*
+ * Emulation of one-sided read/write for nodes without RDMA. An agent kthread
+ * on the exporting side serves requests against the exported buffer; the
+ * requester splits a transfer into chunks and keeps up to KTCP_RW_PIPELINE
+ * of them in flight on the multiplexed txids.
+ */
+#define KTCP_RW_READ	1
+#define KTCP_RW_WRITE	2
+
+/* Small enough for a request frame to go through the receive ring. */
+#define KTCP_RW_CHUNK (KTCP_RING_SIZE / 2)
+#define KTCP_RW_PIPELINE 8
+
+struct ktcp_rw_req {
+	uint32_t op;
+	uint32_t length;
+	uint64_t offset;
+} __attribute__((packed));
+
+struct ktcp_rw_server {
+	struct ktcp_cb *cb;
+	char *buf;
+	size_t size;
+	struct task_struct *agent;
+};
+
+static int ktcp_rw_agent(void *data)
+{
+	struct ktcp_rw_server *srv = data;
+	struct ktcp_rw_req req;
+	struct kvec vec;
+	uint16_t txid;
+	char *msg;
+	int ret;
+
+	msg = kvmalloc(sizeof(req) + KTCP_RW_CHUNK, GFP_KERNEL);
+	if (!msg)
+		goto out_wait;
+
+	while (!kthread_should_stop()) {
+		ret = ktcp_receive_req(srv->cb, msg, sizeof(req) + KTCP_RW_CHUNK,
+				&txid);
+		/* An oversized request has been dropped, fail just that one. */
+		if (ret == -EMSGSIZE) {
+			ret = ktcp_reply_err(srv->cb, txid, -EMSGSIZE);
+			if (ret < 0)
+				break;
+			continue;
+		}
+		if (ret < 0)
+			break;
+		if (ret < sizeof(req)) {
+			ktcp_reply_err(srv->cb, txid, -EPROTO);
+			continue;
+		}
+		memcpy(&req, msg, sizeof(req));
+		if (req.length > KTCP_RW_CHUNK || req.offset > srv->size ||
+				req.length > srv->size - req.offset) {
+			ktcp_reply_err(srv->cb, txid, -EINVAL);
+			continue;
+		}
+
+		switch (req.op) {
+		case KTCP_RW_READ:
+			/* Straight from the exported buffer. */
+			vec.iov_base = srv->buf + req.offset;
+			vec.iov_len = req.length;
+			ret = ktcp_send_frame(srv->cb, txid, KTCP_HDR_REPLY, 0, &vec, 1);
+			break;
+		case KTCP_RW_WRITE:
+			if (ret - sizeof(req) != req.length) {
+				ret = ktcp_reply_err(srv->cb, txid, -EPROTO);
+				break;
+			}
+			memcpy(srv->buf + req.offset, msg + sizeof(req), req.length);
+			ret = ktcp_send_frame(srv->cb, txid, KTCP_HDR_REPLY, 0, NULL, 0);
+			break;
+		default:
+			ret = ktcp_reply_err(srv->cb, txid, -EOPNOTSUPP);
+			break;
+		}
+		if (ret < 0)
+			break;
+	}
+	kvfree(msg);
+
+out_wait:
+	/* The connection is gone, wait for ktcp_rw_stop(). */
+	set_current_state(TASK_INTERRUPTIBLE);
+	while (!kthread_should_stop()) {
+		schedule();
+		set_current_state(TASK_INTERRUPTIBLE);
+	}
+	__set_current_state(TASK_RUNNING);
+	return 0;
+}
+
+int ktcp_rw_serve(struct ktcp_cb *cb, char *buf, size_t size,
+		struct ktcp_rw_server **srvp)
+{
+	struct ktcp_rw_server *srv;
+
+	if (cb == NULL || buf == NULL || srvp == NULL)
+		return -EINVAL;
+
+	srv = kzalloc(sizeof(*srv), GFP_KERNEL);
+	if (!srv)
+		return -ENOMEM;
+	srv->cb = cb;
+	srv->buf = buf;
+	srv->size = size;
+
+	srv->agent = kthread_run(ktcp_rw_agent, srv, "ktcp_rw_agent");
+	if (IS_ERR(srv->agent)) {
+		int ret = PTR_ERR(srv->agent);
+
+		printk(KERN_ERR "%s: kthread_run failed, return %d\n", __func__, ret);
+		kfree(srv);
+		return ret;
+	}
+
+	*srvp = srv;
 	return SUCCESS;
 }
+EXPORT_SYMBOL_GPL(ktcp_rw_serve);
+
+void ktcp_rw_stop(struct ktcp_rw_server *srv)
+{
+	if (srv == NULL)
+		return;
+
+	/* Fails the receive the agent is blocked in. */
+	kernel_sock_shutdown(srv->cb->socket, SHUT_RDWR);
+	kthread_stop(srv->agent);
+	kfree(srv);
+}
+EXPORT_SYMBOL_GPL(ktcp_rw_stop);
+
+/*
+ * With wait, sleep until another requester frees a txid rather than fail
+ * with -EAGAIN.
+ */
+static int ktcp_rw_issue(struct ktcp_cb *cb, uint32_t op, size_t offset,
+		const char *buffer, size_t length, uint16_t *txid, bool wait)
+{
+	struct ktcp_rw_req req = {
+		.op = op,
+		.length = length,
+		.offset = offset,
+	};
+	struct kvec vec[2] = {
+		{ .iov_base = &req, .iov_len = sizeof(req) },
+		{ .iov_base = (char *)buffer, .iov_len = length },
+	};
+	int ret;
+
+	if (wait)
+		ret = wait_event_interruptible(cb->txid_wait,
+				ktcp_txid_alloc(cb, txid) == SUCCESS);
+	else
+		ret = ktcp_txid_alloc(cb, txid);
+	if (ret < 0)
+		return ret;
+	ret = ktcp_send_frame(cb, *txid, 0, 0, vec, op == KTCP_RW_WRITE ? 2 : 1);
+	if (ret < 0)
+		ktcp_txid_free(cb, *txid);
+	return ret;
+}
+
+static ssize_t ktcp_rw_xfer(struct ktcp_cb *cb, uint32_t op, size_t offset,
+		char *buffer, size_t length)
+{
+	uint16_t txids[KTCP_RW_PIPELINE];
+	unsigned int head = 0, tail = 0;
+	size_t issued = 0, done = 0, chunk;
+	char ack;
+	int ret = 0;
+
+	if (cb == NULL || buffer == NULL)
+		return -EINVAL;
+	if (length > SSIZE_MAX)
+		return -EINVAL;
+
+	while (done < length) {
+		/* Keep the pipe full. */
+		while (issued < length && tail - head < KTCP_RW_PIPELINE) {
+			chunk = min_t(size_t, length - issued, KTCP_RW_CHUNK);
+			/*
+			 * Out of txids, shared with other requesters: wait for our
+			 * oldest chunk if we have one in flight, else for theirs.
+			 */
+			ret = ktcp_rw_issue(cb, op, offset + issued, buffer + issued,
+					chunk, &txids[tail % KTCP_RW_PIPELINE], tail == head);
+			if (ret == -EAGAIN && tail != head)
+				break;
+			if (ret < 0)
+				goto out;
+			tail++;
+			issued += chunk;
+		}
+
+		/*
+		 * Wait for the oldest chunk, the replies to the others are parked
+		 * meanwhile. Read data lands in place, a write reply is empty.
+		 */
+		chunk = min_t(size_t, length - done, KTCP_RW_CHUNK);
+		if (op == KTCP_RW_READ)
+			ret = ktcp_receive_tx(cb, txids[head % KTCP_RW_PIPELINE],
+					buffer + done, chunk);
+		else
+			ret = ktcp_receive_tx(cb, txids[head % KTCP_RW_PIPELINE],
+					&ack, sizeof(ack));
+		ktcp_txid_free(cb, txids[head % KTCP_RW_PIPELINE]);
+		head++;
+		if (ret < 0)
+			goto out;
+		/* A short read would leave stale data in the buffer. */
+		if (op == KTCP_RW_READ && ret != chunk) {
+			ret = -EIO;
+			goto out;
+		}
+		done += chunk;
+	}
+
+out:
+	/* Late replies to these are dropped. */
+	for (; head != tail; head++)
+		ktcp_txid_free(cb, txids[head % KTCP_RW_PIPELINE]);
+	return ret < 0 ? (ssize_t)ret : (ssize_t)length;
+}
+
+ssize_t ktcp_rw_read(struct ktcp_cb *cb, size_t offset, char *buffer,
+		size_t length)
+{
+	return ktcp_rw_xfer(cb, KTCP_RW_READ, offset, buffer, length);
+}
+EXPORT_SYMBOL_GPL(ktcp_rw_read);
+
+ssize_t ktcp_rw_write(struct ktcp_cb *cb, size_t offset, const char *buffer,
+		size_t length)
+{
+	return ktcp_rw_xfer(cb, KTCP_RW_WRITE, offset, (char *)buffer, length);
+}
+EXPORT_SYMBOL_GPL(ktcp_rw_write);
+
+MODULE_DESCRIPTION("Kernel TCP transport");
+MODULE_LICENSE("GPL");
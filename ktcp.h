@@ -20,6 +20,9 @@
 // How many requests can be buffered in the listening queue
 #define DEFAULT_BACKLOG 16
 
+/* Number of txids, and so of requests in flight, per connection. */
+#define KTCP_TXID_NR 1024
+
 #define SIZE_SHIFT 21UL
 #define EVAL_ITER 2000
 
@@ -34,18 +37,119 @@ typedef struct tx_add {
 
 struct ktcp_cb;
 
+/*
+ * How ktcp_receive() waits for data. KTCP_RX_EVENT, the default, sleeps
+ * until the socket data-ready callback fires; KTCP_RX_POLL retries with a
+ * growing sleep of up to 1 ms; KTCP_RX_BUSY_POLL spins on the socket for a
+ * while before sleeping.
+ */
+enum ktcp_rx_mode {
+	KTCP_RX_EVENT,
+	KTCP_RX_POLL,
+	KTCP_RX_BUSY_POLL,
+};
+
+/*
+ * Socket options for a connection, zero keeps the kernel default. A non-zero
+ * busy_poll (usecs) also sets SO_BUSY_POLL and selects KTCP_RX_BUSY_POLL.
+ */
+struct ktcp_tuning {
+	bool nodelay;
+	bool quickack;
+	int sndbuf;
+	int rcvbuf;
+	unsigned int busy_poll;
+};
+
 typedef uint32_t extent_t;
 
 int ktcp_send(struct ktcp_cb *cb, const char *buffer, size_t length);
 
-int ktcp_receive(struct ktcp_cb *cb, char *buffer);
+/*
+ * Send a page-aligned payload by page reference instead of copying it.
+ * Returns once the peer has acknowledged the data, so the pages may be
+ * reused. Other payloads fall back to ktcp_send().
+ */
+int ktcp_send_zerocopy(struct ktcp_cb *cb, const char *buffer, size_t length);
+
+/*
+ * Receive the next frame into buffer of len bytes. A larger frame is
+ * dropped and -EMSGSIZE returned; the same goes for ktcp_receive_tx() and
+ * ktcp_receive_req().
+ */
+int ktcp_receive(struct ktcp_cb *cb, char *buffer, size_t len);
+
+/*
+ * Batch small frames and send them together when the batch fills, on
+ * ktcp_flush(), or usecs after the first one. 0 flushes and turns batching
+ * off. Every receive flushes before it waits.
+ */
+int ktcp_set_batch(struct ktcp_cb *cb, unsigned int usecs);
+
+int ktcp_flush(struct ktcp_cb *cb);
+
+/*
+ * Multiplexed requests. A requester takes a txid, sends with ktcp_send_tx()
+ * and waits in ktcp_receive_tx() for the ktcp_reply_tx() of the peer, which
+ * got the request and its txid from ktcp_receive_req(). Any number of
+ * threads may do this at once on one connection. ktcp_txid_alloc() returns
+ * -EAGAIN when all txids are in flight.
+ */
+int ktcp_txid_alloc(struct ktcp_cb *cb, uint16_t *txid);
+
+void ktcp_txid_free(struct ktcp_cb *cb, uint16_t txid);
+
+int ktcp_send_tx(struct ktcp_cb *cb, uint16_t txid, const char *buffer,
+		size_t length);
+
+int ktcp_reply_tx(struct ktcp_cb *cb, uint16_t txid, const char *buffer,
+		size_t length);
+
+/* Fail the request, its ktcp_receive_tx() returns err. */
+int ktcp_reply_err(struct ktcp_cb *cb, uint16_t txid, int err);
+
+int ktcp_receive_tx(struct ktcp_cb *cb, uint16_t txid, char *buffer,
+		size_t len);
+
+int ktcp_receive_req(struct ktcp_cb *cb, char *buffer, size_t len,
+		uint16_t *txid);
+
+int ktcp_set_rx_mode(struct ktcp_cb *cb, enum ktcp_rx_mode mode);
+
+/*
+ * One-sided read/write emulated over TCP. ktcp_rw_serve() starts an agent
+ * that serves ktcp_rw_read() and ktcp_rw_write() of the peer against buf,
+ * until ktcp_rw_stop(), which also shuts the connection down.
+ */
+struct ktcp_rw_server;
+
+int ktcp_rw_serve(struct ktcp_cb *cb, char *buf, size_t size,
+		struct ktcp_rw_server **srvp);
+
+void ktcp_rw_stop(struct ktcp_rw_server *srv);
+
+/*
+ * When other requesters hold every txid, these sleep until one is freed.
+ * @return length, or a negative errno.
+ */
+ssize_t ktcp_rw_read(struct ktcp_cb *cb, size_t offset, char *buffer,
+		size_t length);
+
+ssize_t ktcp_rw_write(struct ktcp_cb *cb, size_t offset, const char *buffer,
+		size_t length);
 
 int ktcp_connect(const char *host, const char *port, struct ktcp_cb **conn_cb);
 
+int ktcp_connect_tuned(const char *host, const char *port,
+		const struct ktcp_tuning *tuning, struct ktcp_cb **conn_cb);
+
 int ktcp_listen(const char *host, const char *port, struct ktcp_cb **listen_cb);
 
 int ktcp_accept(struct ktcp_cb *listen_cb, struct ktcp_cb **accept_cb);
 
+int ktcp_accept_tuned(struct ktcp_cb *listen_cb,
+		const struct ktcp_tuning *tuning, struct ktcp_cb **accept_cb);
+
 int ktcp_release(struct ktcp_cb *conn_cb);
 
 #endif /* __KVM_X86_KTCP_H */
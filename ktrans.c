@@ -0,0 +1,453 @@
+/*
+ * Transport abstraction over krdma and ktcp
+ *
+ * Higher layers pick RDMA, TCP or AUTO at connect time and use the same
+ * send/receive calls on either.
+ *
+ * Copyright (C) 2019, Trusted Cloud Group, Shanghai Jiao Tong University.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/kthread.h>
+#include <linux/delay.h>
+#include <linux/slab.h>
+#include <linux/sched/signal.h>
+#include <linux/wait.h>
+
+#include "krdma.h"
+#include "ktrans.h"
+
+/* Both listeners of a KTRANS_AUTO listen cb, feeding one accept queue. */
+struct ktrans_listener {
+	struct krdma_cb *rdma;
+	struct ktcp_cb *tcp;
+	struct task_struct *tcp_acceptor;
+
+	spinlock_t lock;
+	struct list_head ready;
+	wait_queue_head_t wait;
+	bool stopping;
+};
+
+static int ktrans_rdma_send(void *conn, const char *buffer, size_t length)
+{
+	return krdma_send(conn, buffer, length);
+}
+
+static int ktrans_rdma_receive(void *conn, char *buffer, size_t length)
+{
+	return krdma_receive(conn, buffer, length);
+}
+
+static int ktrans_rdma_connect(const char *host, const char *port, void **conn)
+{
+	return krdma_connect(host, port, (struct krdma_cb **)conn);
+}
+
+static int ktrans_rdma_listen(const char *host, const char *port, void **conn)
+{
+	return krdma_listen(host, port, (struct krdma_cb **)conn);
+}
+
+static int ktrans_rdma_accept(void *listen_conn, void **conn)
+{
+	return krdma_accept(listen_conn, (struct krdma_cb **)conn);
+}
+
+static int ktrans_rdma_release(void *conn)
+{
+	return krdma_free_cb(conn);
+}
+
+const struct ktrans_ops ktrans_rdma_ops = {
+	.name		= "rdma",
+	.send		= ktrans_rdma_send,
+	.receive	= ktrans_rdma_receive,
+	.connect	= ktrans_rdma_connect,
+	.listen		= ktrans_rdma_listen,
+	.accept		= ktrans_rdma_accept,
+	.release	= ktrans_rdma_release,
+};
+
+static int ktrans_tcp_send(void *conn, const char *buffer, size_t length)
+{
+	return ktcp_send(conn, buffer, length);
+}
+
+static int ktrans_tcp_receive(void *conn, char *buffer, size_t length)
+{
+	return ktcp_receive(conn, buffer, length);
+}
+
+static int ktrans_tcp_connect(const char *host, const char *port, void **conn)
+{
+	return ktcp_connect(host, port, (struct ktcp_cb **)conn);
+}
+
+static int ktrans_tcp_listen(const char *host, const char *port, void **conn)
+{
+	return ktcp_listen(host, port, (struct ktcp_cb **)conn);
+}
+
+static int ktrans_tcp_accept(void *listen_conn, void **conn)
+{
+	return ktcp_accept(listen_conn, (struct ktcp_cb **)conn);
+}
+
+static int ktrans_tcp_release(void *conn)
+{
+	return ktcp_release(conn);
+}
+
+const struct ktrans_ops ktrans_tcp_ops = {
+	.name		= "tcp",
+	.send		= ktrans_tcp_send,
+	.receive	= ktrans_tcp_receive,
+	.connect	= ktrans_tcp_connect,
+	.listen		= ktrans_tcp_listen,
+	.accept		= ktrans_tcp_accept,
+	.release	= ktrans_tcp_release,
+};
+
+static struct ktrans_cb *ktrans_alloc_cb(const struct ktrans_ops *ops,
+		void *conn)
+{
+	struct ktrans_cb *cb;
+
+	cb = kzalloc(sizeof(*cb), GFP_KERNEL);
+	if (!cb)
+		return NULL;
+	cb->ops = ops;
+	cb->conn = conn;
+	INIT_LIST_HEAD(&cb->entry);
+	return cb;
+}
+
+static int ktrans_tcp_port(const char *port, char *tcp_port, size_t len)
+{
+	long portdec;
+	int ret;
+
+	ret = kstrtol(port, 10, &portdec);
+	if (ret < 0)
+		return ret;
+	snprintf(tcp_port, len, "%ld", portdec + KTRANS_TCP_PORT_OFFSET);
+	return 0;
+}
+
+int ktrans_send(struct ktrans_cb *cb, const char *buffer, size_t length)
+{
+	if (cb == NULL || cb->ops == NULL)
+		return -EINVAL;
+	return cb->ops->send(cb->conn, buffer, length);
+}
+EXPORT_SYMBOL_GPL(ktrans_send);
+
+int ktrans_receive(struct ktrans_cb *cb, char *buffer, size_t length)
+{
+	if (cb == NULL || cb->ops == NULL)
+		return -EINVAL;
+	return cb->ops->receive(cb->conn, buffer, length);
+}
+EXPORT_SYMBOL_GPL(ktrans_receive);
+
+int ktrans_connect(enum ktrans_type type, const char *host, const char *port,
+		struct ktrans_cb **conn_cb)
+{
+	const struct ktrans_ops *ops;
+	char tcp_port[8];
+	void *conn;
+	int ret;
+
+	if (host == NULL || port == NULL || conn_cb == NULL)
+		return -EINVAL;
+
+	switch (type) {
+	case KTRANS_RDMA:
+		ops = &ktrans_rdma_ops;
+		ret = ops->connect(host, port, &conn);
+		break;
+	case KTRANS_TCP:
+		ops = &ktrans_tcp_ops;
+		ret = ops->connect(host, port, &conn);
+		break;
+	case KTRANS_AUTO:
+		ops = &ktrans_rdma_ops;
+		ret = ops->connect(host, port, &conn);
+		if (ret == 0)
+			break;
+		printk(KERN_WARNING "%s: rdma connect to %s:%s failed, return %d, "
+				"falling back to tcp\n", __func__, host, port, ret);
+		ret = ktrans_tcp_port(port, tcp_port, sizeof(tcp_port));
+		if (ret < 0)
+			return ret;
+		ops = &ktrans_tcp_ops;
+		ret = ops->connect(host, tcp_port, &conn);
+		break;
+	default:
+		return -EINVAL;
+	}
+	if (ret < 0) {
+		printk(KERN_ERR "%s: %s connect failed, return %d\n",
+				__func__, ops->name, ret);
+		return ret;
+	}
+
+	*conn_cb = ktrans_alloc_cb(ops, conn);
+	if (*conn_cb == NULL) {
+		ops->release(conn);
+		return -ENOMEM;
+	}
+	return 0;
+}
+EXPORT_SYMBOL_GPL(ktrans_connect);
+
+static void ktrans_listener_push(struct ktrans_listener *l,
+		const struct ktrans_ops *ops, void *conn)
+{
+	struct ktrans_cb *cb = ktrans_alloc_cb(ops, conn);
+
+	if (!cb) {
+		ops->release(conn);
+		return;
+	}
+	spin_lock(&l->lock);
+	list_add_tail(&cb->entry, &l->ready);
+	spin_unlock(&l->lock);
+	wake_up_interruptible(&l->wait);
+}
+
+/* Called on an accept engine worker. */
+static int ktrans_rdma_accepted(struct krdma_cb *conn, void *data)
+{
+	ktrans_listener_push(data, &ktrans_rdma_ops, conn);
+	return 0;
+}
+
+static int ktrans_tcp_acceptor(void *data)
+{
+	struct ktrans_listener *l = data;
+	struct ktcp_cb *conn;
+	int ret;
+
+	/* ktrans_release() interrupts the blocking accept with SIGKILL. */
+	allow_signal(SIGKILL);
+	while (!kthread_should_stop()) {
+		ret = ktcp_accept(l->tcp, &conn);
+		if (ret == -EAGAIN)
+			continue;
+		if (ret < 0) {
+			/* Interrupted for good, or the listening socket is gone. */
+			if (signal_pending(current) || ret == -EINVAL)
+				break;
+			msleep(10);
+			continue;
+		}
+		ktrans_listener_push(l, &ktrans_tcp_ops, conn);
+	}
+
+	/* Wait for kthread_stop(), the pending signal would wake us at once. */
+	flush_signals(current);
+	set_current_state(TASK_INTERRUPTIBLE);
+	while (!kthread_should_stop()) {
+		schedule();
+		set_current_state(TASK_INTERRUPTIBLE);
+	}
+	__set_current_state(TASK_RUNNING);
+	return 0;
+}
+
+static int ktrans_listen_auto(const char *host, const char *port,
+		struct ktrans_cb **listen_cb)
+{
+	struct ktrans_listener *l;
+	struct ktrans_cb *cb;
+	char tcp_port[8];
+	int ret;
+
+	ret = ktrans_tcp_port(port, tcp_port, sizeof(tcp_port));
+	if (ret < 0)
+		return ret;
+
+	cb = ktrans_alloc_cb(NULL, NULL);
+	l = kzalloc(sizeof(*l), GFP_KERNEL);
+	if (!cb || !l) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+	spin_lock_init(&l->lock);
+	INIT_LIST_HEAD(&l->ready);
+	init_waitqueue_head(&l->wait);
+	cb->listener = l;
+
+	/* A node without RDMA devices still listens on TCP. */
+	ret = krdma_listen(host, port, &l->rdma);
+	if (ret < 0) {
+		printk(KERN_WARNING "%s: rdma listen failed, return %d, tcp only\n",
+				__func__, ret);
+		l->rdma = NULL;
+	}
+
+	ret = ktcp_listen(host, tcp_port, &l->tcp);
+	if (ret < 0) {
+		printk(KERN_ERR "%s: ktcp_listen failed, return %d\n", __func__, ret);
+		goto out_release_rdma;
+	}
+
+	l->tcp_acceptor = kthread_run(ktrans_tcp_acceptor, l, "ktrans_accept");
+	if (IS_ERR(l->tcp_acceptor)) {
+		ret = PTR_ERR(l->tcp_acceptor);
+		goto out_release_tcp;
+	}
+
+	if (l->rdma) {
+		ret = krdma_accept_engine_start(l->rdma, RDMA_ACCEPT_WORKERS,
+				ktrans_rdma_accepted, l);
+		if (ret < 0) {
+			printk(KERN_ERR "%s: krdma_accept_engine_start failed, return %d\n",
+					__func__, ret);
+			goto out_stop_acceptor;
+		}
+	}
+
+	*listen_cb = cb;
+	return 0;
+
+out_stop_acceptor:
+	send_sig(SIGKILL, l->tcp_acceptor, 1);
+	kthread_stop(l->tcp_acceptor);
+out_release_tcp:
+	ktcp_release(l->tcp);
+out_release_rdma:
+	if (l->rdma)
+		krdma_free_cb(l->rdma);
+out_free:
+	kfree(l);
+	kfree(cb);
+	return ret;
+}
+
+int ktrans_listen(enum ktrans_type type, const char *host, const char *port,
+		struct ktrans_cb **listen_cb)
+{
+	const struct ktrans_ops *ops;
+	void *conn;
+	int ret;
+
+	if (host == NULL || port == NULL || listen_cb == NULL)
+		return -EINVAL;
+
+	switch (type) {
+	case KTRANS_RDMA:
+		ops = &ktrans_rdma_ops;
+		break;
+	case KTRANS_TCP:
+		ops = &ktrans_tcp_ops;
+		break;
+	case KTRANS_AUTO:
+		return ktrans_listen_auto(host, port, listen_cb);
+	default:
+		return -EINVAL;
+	}
+
+	ret = ops->listen(host, port, &conn);
+	if (ret < 0) {
+		printk(KERN_ERR "%s: %s listen failed, return %d\n",
+				__func__, ops->name, ret);
+		return ret;
+	}
+
+	*listen_cb = ktrans_alloc_cb(ops, conn);
+	if (*listen_cb == NULL) {
+		ops->release(conn);
+		return -ENOMEM;
+	}
+	return 0;
+}
+EXPORT_SYMBOL_GPL(ktrans_listen);
+
+int ktrans_accept(struct ktrans_cb *listen_cb, struct ktrans_cb **accept_cb)
+{
+	struct ktrans_listener *l;
+	void *conn;
+	int ret;
+
+	if (listen_cb == NULL || accept_cb == NULL)
+		return -EINVAL;
+
+	l = listen_cb->listener;
+	if (l == NULL) {
+		ret = listen_cb->ops->accept(listen_cb->conn, &conn);
+		if (ret < 0)
+			return ret;
+		*accept_cb = ktrans_alloc_cb(listen_cb->ops, conn);
+		if (*accept_cb == NULL) {
+			listen_cb->ops->release(conn);
+			return -ENOMEM;
+		}
+		return 0;
+	}
+
+	ret = wait_event_interruptible(l->wait,
+			!list_empty_careful(&l->ready) || READ_ONCE(l->stopping));
+	if (ret < 0)
+		return ret;
+
+	spin_lock(&l->lock);
+	if (list_empty(&l->ready)) {
+		spin_unlock(&l->lock);
+		return -ESHUTDOWN;
+	}
+	*accept_cb = list_first_entry(&l->ready, struct ktrans_cb, entry);
+	list_del_init(&(*accept_cb)->entry);
+	spin_unlock(&l->lock);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(ktrans_accept);
+
+static void ktrans_release_listener(struct ktrans_listener *l)
+{
+	struct ktrans_cb *cb, *tmp;
+
+	WRITE_ONCE(l->stopping, true);
+	wake_up_interruptible_all(&l->wait);
+
+	if (l->rdma)
+		krdma_accept_engine_stop(l->rdma);
+	send_sig(SIGKILL, l->tcp_acceptor, 1);
+	kthread_stop(l->tcp_acceptor);
+
+	/* Connections nobody accepted. */
+	list_for_each_entry_safe(cb, tmp, &l->ready, entry) {
+		list_del(&cb->entry);
+		ktrans_release(cb);
+	}
+
+	ktcp_release(l->tcp);
+	if (l->rdma)
+		krdma_free_cb(l->rdma);
+	kfree(l);
+}
+
+int ktrans_release(struct ktrans_cb *cb)
+{
+	int ret = 0;
+
+	if (cb == NULL)
+		return -EINVAL;
+
+	if (cb->listener)
+		ktrans_release_listener(cb->listener);
+	else
+		ret = cb->ops->release(cb->conn);
+	kfree(cb);
+	return ret;
+}
+EXPORT_SYMBOL_GPL(ktrans_release);
+
+MODULE_DESCRIPTION("Transport abstraction over krdma and ktcp");
+MODULE_LICENSE("GPL");
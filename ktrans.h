@@ -0,0 +1,73 @@
+#ifndef __KVM_X86_KTRANS_H
+#define __KVM_X86_KTRANS_H
+/*
+ * Transport abstraction over krdma and ktcp
+ *
+ * Copyright (C) 2019, Trusted Cloud Group, Shanghai Jiao Tong University.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include <linux/kernel.h>
+#include <linux/list.h>
+
+/*
+ * KTRANS_AUTO connects over RDMA and falls back to TCP on port +
+ * KTRANS_TCP_PORT_OFFSET; an AUTO listener accepts both, so nodes without
+ * RDMA can talk to RDMA nodes. The offset keeps the TCP port clear of the
+ * RDMA one on iWARP, where they share a port space.
+ */
+enum ktrans_type {
+	KTRANS_RDMA,
+	KTRANS_TCP,
+	KTRANS_AUTO,
+};
+
+#define KTRANS_TCP_PORT_OFFSET 1
+
+struct ktrans_ops {
+	const char *name;
+	int (*send)(void *conn, const char *buffer, size_t length);
+	int (*receive)(void *conn, char *buffer, size_t length);
+	int (*connect)(const char *host, const char *port, void **conn);
+	int (*listen)(const char *host, const char *port, void **conn);
+	int (*accept)(void *listen_conn, void **conn);
+	int (*release)(void *conn);
+};
+
+extern const struct ktrans_ops ktrans_rdma_ops;
+extern const struct ktrans_ops ktrans_tcp_ops;
+
+struct ktrans_listener;
+
+struct ktrans_cb {
+	const struct ktrans_ops *ops;
+	void *conn;
+
+	/* Set for KTRANS_AUTO listeners, which have no ops of their own. */
+	struct ktrans_listener *listener;
+	struct list_head entry;
+};
+
+static inline const char *ktrans_name(struct ktrans_cb *cb)
+{
+	return cb->ops ? cb->ops->name : "auto";
+}
+
+int ktrans_send(struct ktrans_cb *cb, const char *buffer, size_t length);
+
+/* At most length bytes; a larger message fails with -EMSGSIZE. */
+int ktrans_receive(struct ktrans_cb *cb, char *buffer, size_t length);
+
+int ktrans_connect(enum ktrans_type type, const char *host, const char *port,
+		struct ktrans_cb **conn_cb);
+
+int ktrans_listen(enum ktrans_type type, const char *host, const char *port,
+		struct ktrans_cb **listen_cb);
+
+int ktrans_accept(struct ktrans_cb *listen_cb, struct ktrans_cb **accept_cb);
+
+int ktrans_release(struct ktrans_cb *cb);
+
+#endif /* __KVM_X86_KTRANS_H */